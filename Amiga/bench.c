@@ -0,0 +1,464 @@
+/*
+ * SonicArranger packed format converter - benchmark
+ *
+ * Measures the stages of a conversion: the search with find_module(),
+ * which skips hits that are no module like the converter does, the
+ * parse of the module layout and writing the SOAR output to memory.
+ * Inputs are synthetic modules at the end of large random buffers and
+ * optionally a corpus of real files. The files are read before the
+ * clock starts, so only the conversion itself is measured.
+ *
+ * by Thomas Meyer <mnemotron@gmail.com>
+ * Created: 2026-10-14
+ * Last change: 2026-10-14
+ *
+ * Host only, build with: make bench
+ */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sonicconv.h"
+
+/* latencies of one stage, in microseconds */
+typedef struct {
+    char *name;
+    double *t;
+    long cnt;
+    long max;
+    // bytes handled by the stage, for the throughput
+    double bytes;
+} stage_times;
+
+/* all stages of a benchmark run */
+typedef struct {
+    stage_times scan;
+    stage_times parse;
+    stage_times write;
+    long files;
+    long not_found;
+    double total;
+} bench_run;
+
+/* input of a run, read into memory */
+typedef struct {
+    char *name;
+    char *dat;
+    long size;
+} bench_input;
+
+/*
+ * now_us - Monotonic time in microseconds.
+ */
+double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * add_time - Record one latency of a stage.
+ */
+void add_time(stage_times *st, double t, long bytes) {
+    double *p;
+
+    if(st->cnt == st->max) {
+        p = realloc(st->t, (st->max * 2 + 64) * sizeof(double));
+        if(p == NULL) {
+            printf("Cannot allocate memory for timings!\n");
+            exit(20);
+        }
+        st->t = p;
+        st->max = st->max * 2 + 64;
+    }
+
+    st->t[st->cnt++] = t;
+    st->bytes += bytes;
+}
+
+/*
+ * time_cmp - Order latencies for the percentiles.
+ */
+int time_cmp(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * percentile - The p-th percentile of the sorted latencies.
+ */
+double percentile(stage_times *st, double p) {
+    long i;
+
+    i = (long)(p / 100.0 * (st->cnt - 1) + 0.5);
+
+    return st->t[i];
+}
+
+/*
+ * print_stage - Print throughput and latency percentiles of a stage.
+ */
+void print_stage(stage_times *st) {
+    double sum = 0;
+    long i;
+
+    if(st->cnt == 0)
+        return;
+
+    qsort(st->t, st->cnt, sizeof(double), time_cmp);
+    for(i = 0; i < st->cnt; i++)
+        sum += st->t[i];
+
+    printf("  %-6s %10.1f MB/s  p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  max %9.1f us\n",
+        st->name, sum > 0 ? st->bytes / sum : 0.0,
+        percentile(st, 50), percentile(st, 90), percentile(st, 99), st->t[st->cnt - 1]);
+}
+
+/*
+ * init_run - Set up empty timings.
+ */
+void init_run(bench_run *r) {
+    memset(r, 0, sizeof(bench_run));
+    r->scan.name = "scan";
+    r->parse.name = "parse";
+    r->write.name = "write";
+}
+
+/*
+ * free_run - Release the timings.
+ */
+void free_run(bench_run *r) {
+    free(r->scan.t);
+    free(r->parse.t);
+    free(r->write.t);
+}
+
+/*
+ * print_run - Print the results of a run.
+ */
+void print_run(char *title, bench_run *r) {
+    printf("%s: %ld file(s) converted", title, r->files);
+    if(r->not_found > 0)
+        printf(", %ld without module", r->not_found);
+    printf(", %.1f files/s\n", r->total > 0 ? r->files / (r->total / 1e6) : 0.0);
+
+    print_stage(&r->scan);
+    print_stage(&r->parse);
+    print_stage(&r->write);
+}
+
+/*
+ * bench_one - Run the stages once over an input. The output buffer
+ * grows as needed and is kept between calls.
+ */
+void bench_one(bench_input *in, bench_run *r, arena *ar, char **out, long *out_max) {
+    module_layout ml;
+    out_piece pieces[MAX_PIECES];
+    char *head;
+    char *p;
+    double t0, t1, t2, t3;
+    long offset;
+    long size;
+    int piece_cnt;
+    int i;
+
+    arena_reset(ar);
+
+    // Without an arena the search only checks the sections
+    t0 = now_us();
+    offset = find_module(in->dat, in->size, &ml, NULL);
+    t1 = now_us();
+
+    add_time(&r->scan, t1 - t0, offset >= 0 ? offset : in->size);
+    if(offset < 0 || parse_module(in->dat, in->size, offset, &ml, ar) != 0) {
+        r->not_found++;
+        r->total += t1 - t0;
+        return;
+    }
+    t2 = now_us();
+
+    size = soar_output_size(&ml);
+    if(size > *out_max) {
+        p = realloc(*out, size);
+        if(p == NULL) {
+            printf("Cannot allocate memory for output!\n");
+            exit(20);
+        }
+        *out = p;
+        *out_max = size;
+    }
+
+    head = arena_alloc(ar, soar_head_size(&ml));
+    if(head == NULL) {
+        printf("Cannot allocate memory for output!\n");
+        exit(20);
+    }
+    piece_cnt = soar_pieces(in->dat, &ml, head, pieces);
+    p = *out;
+    for(i = 0; i < piece_cnt; i++) {
+        memcpy(p, pieces[i].base, pieces[i].len);
+        p += pieces[i].len;
+    }
+    t3 = now_us();
+
+    add_time(&r->parse, t2 - t1, module_end(&ml) - offset);
+    add_time(&r->write, t3 - t2, size);
+    r->files++;
+    r->total += t3 - t0;
+}
+
+/*
+ * next_rand - xorshift32, the same numbers on every run.
+ */
+u32 next_rand(u32 *seed) {
+    u32 x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *seed = x;
+}
+
+/*
+ * make_module - Write a synthetic module with all sections to p.
+ * Returns its length.
+ */
+long make_module(char *p, u32 *seed) {
+    static long cnt[7] = { 8, 16, 512, 16, 8, 4, 4 };
+    static long size[7] = { 12, 16, 4, 0x98, 128, 128, 128 };
+    long offset = 0x28;
+    long len;
+    long i;
+    long j;
+
+    memset(p, 0, 0x28);
+    for(i = 0; i < 7; i++) {
+        put_long(p + i * 4, offset);
+        len = cnt[i] * size[i];
+        for(j = 0; j < len; j++)
+            p[offset + j] = (char)next_rand(seed);
+        if(i == 3) {
+            // sampled instruments, using samples 0 to 7
+            for(j = 0; j < cnt[i]; j++) {
+                p[offset + j * 0x98] = 0;
+                p[offset + j * 0x98 + 1] = 0;
+                p[offset + j * 0x98 + 2] = 0;
+                p[offset + j * 0x98 + 3] = (char)(j & 7);
+                memset(p + offset + j * 0x98 + 0x7a, 0, 30);
+                sprintf(p + offset + j * 0x98 + 0x7a, "instrument %ld", j);
+            }
+        }
+        offset += len;
+    }
+
+    // Sample section: 8 samples of 16 KB
+    put_long(p + 7 * 4, offset);
+    put_long(p + offset, 8);
+    for(i = 0; i < 8; i++)
+        put_long(p + offset + 4 + i * 4, 0x4000);
+    offset += 4 + 8 * 4;
+    for(j = 0; j < 8 * 0x4000; j++)
+        p[offset + j] = (char)next_rand(seed);
+
+    return offset + 8 * 0x4000;
+}
+
+/*
+ * make_synthetic - Build a buffer of size bytes of random data with a
+ * module at the end. The random part has no 0x28 bytes, so there are
+ * no false hits and the scan always goes over the whole buffer.
+ * The size including the module goes to total.
+ */
+char *make_synthetic(long size, long *total) {
+    char *dat;
+    long i;
+    u32 seed = 0x50415253;
+
+    dat = malloc(size + 0x10000 + 8 * 0x4000);
+    if(dat == NULL)
+        return NULL;
+
+    for(i = 0; i < size; i++) {
+        dat[i] = (char)next_rand(&seed);
+        if(dat[i] == 0x28)
+            dat[i] = 0x29;
+    }
+
+    *total = size + make_module(dat + size, &seed);
+
+    return dat;
+}
+
+/*
+ * read_file - Read a whole file into memory. Returns 0, -1 on failure.
+ */
+int read_file(char *name, bench_input *in) {
+    FILE *f;
+    struct stat st;
+
+    if(stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    f = fopen(name, "rb");
+    if(f == NULL)
+        return -1;
+
+    in->size = st.st_size;
+    in->dat = malloc(in->size > 0 ? in->size : 1);
+    if(in->dat == NULL || (long)fread(in->dat, 1, in->size, f) != in->size) {
+        free(in->dat);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    in->name = malloc(strlen(name) + 1);
+    if(in->name == NULL) {
+        free(in->dat);
+        return -1;
+    }
+    strcpy(in->name, name);
+
+    return 0;
+}
+
+/*
+ * add_input - Read a corpus file, or all files of a corpus directory,
+ * into the input list.
+ */
+void add_input(char *name, bench_input **inputs, long *cnt, long *max) {
+    DIR *dir;
+    struct dirent *de;
+    char *path;
+    bench_input *p;
+
+    dir = opendir(name);
+    if(dir != NULL) {
+        while((de = readdir(dir)) != NULL) {
+            if(de->d_name[0] == '.')
+                continue;
+            path = malloc(strlen(name) + strlen(de->d_name) + 2);
+            if(path == NULL)
+                break;
+            sprintf(path, "%s/%s", name, de->d_name);
+            add_input(path, inputs, cnt, max);
+            free(path);
+        }
+        closedir(dir);
+        return;
+    }
+
+    if(*cnt == *max) {
+        p = realloc(*inputs, (*max * 2 + 64) * sizeof(bench_input));
+        if(p == NULL)
+            return;
+        *inputs = p;
+        *max = *max * 2 + 64;
+    }
+
+    if(read_file(name, *inputs + *cnt) != 0)
+        printf("Cannot read file: %s\n", name);
+    else
+        (*cnt)++;
+}
+
+/*
+ * usage - Print the options.
+ */
+void usage(void) {
+    printf("Usage: sonicbench [options] [corpus]...\n");
+    printf("\n");
+    printf("  -m <MB>     size of the synthetic input, default 16, 0 to skip it\n");
+    printf("  -n <runs>   number of runs over all inputs, default 10\n");
+    printf("\n");
+    printf("A corpus is a file or a directory of files, searched recursively.\n");
+}
+
+int main(int argc, char *argv[]) {
+    arena ar;
+    bench_run r;
+    bench_input syn;
+    bench_input *inputs = NULL;
+    char *out = NULL;
+    char title[64];
+    long out_max = 0;
+    long input_cnt = 0;
+    long input_max = 0;
+    long syn_mb = 16;
+    long runs = 10;
+    long bytes = 0;
+    long n;
+    long j;
+    int i;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            syn_mb = atol(argv[++i]);
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            runs = atol(argv[++i]);
+        else {
+            usage();
+            exit(10);
+        }
+    }
+    if(runs <= 0 || syn_mb < 0) {
+        usage();
+        exit(10);
+    }
+
+    arena_init(&ar);
+
+    if(syn_mb > 0) {
+        syn.name = "synthetic";
+        syn.dat = make_synthetic(syn_mb * 0x100000, &syn.size);
+        if(syn.dat == NULL) {
+            printf("Cannot allocate memory for synthetic input!\n");
+            exit(20);
+        }
+
+        init_run(&r);
+        for(n = 0; n < runs; n++)
+            bench_one(&syn, &r, &ar, &out, &out_max);
+        sprintf(title, "synthetic %ld MB x %ld", syn_mb, runs);
+        print_run(title, &r);
+        free_run(&r);
+        free(syn.dat);
+    }
+
+    for(; i < argc; i++)
+        add_input(argv[i], &inputs, &input_cnt, &input_max);
+
+    if(input_cnt > 0) {
+        for(j = 0; j < input_cnt; j++)
+            bytes += inputs[j].size;
+
+        init_run(&r);
+        for(n = 0; n < runs; n++) {
+            for(j = 0; j < input_cnt; j++)
+                bench_one(&inputs[j], &r, &ar, &out, &out_max);
+        }
+        sprintf(title, "corpus %ld file(s), %.1f MB x %ld", input_cnt, bytes / 1048576.0, runs);
+        print_run(title, &r);
+        free_run(&r);
+
+        for(j = 0; j < input_cnt; j++) {
+            free(inputs[j].name);
+            free(inputs[j].dat);
+        }
+        free(inputs);
+    }
+
+    free(out);
+    arena_free(&ar);
+
+    return 0;
+}
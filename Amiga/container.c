@@ -0,0 +1,807 @@
+/*
+ * SonicArranger packed format converter - containers
+ *
+ * Reads the members of ADF disk images and LhA archives in memory, so
+ * the modules in them can be converted without extracting the files.
+ *
+ * ADF: OFS and FFS floppy images (DD and HD), including directories.
+ * LhA: header levels 0 to 2, stored members and the -lh4- to -lh7-
+ * methods.
+ *
+ * by Thomas Meyer <mnemotron@gmail.com>
+ * Created: 2026-10-14
+ * Last change: 2026-10-14
+ *
+ * Format references:
+ * http://lclevy.free.fr/adflib/adf_info.html
+ * https://github.com/jca02266/lha/blob/master/header.doc.md
+ *
+ * Written with SAS/C 6.5.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sonicconv.h"
+
+/* size of an AmigaDOS floppy block */
+#define ADF_BSIZE 512
+/* entries of the hash table and data block table of a block */
+#define ADF_HT_SIZE (ADF_BSIZE / 4 - 56)
+/* data bytes of an OFS data block */
+#define ADF_OFS_DATA (ADF_BSIZE - 24)
+/* longest path of a member, directories are nested at most this deep */
+#define ADF_MAX_PATH 1024
+#define ADF_MAX_DEPTH 32
+
+/* block types and secondary types */
+#define ADF_T_HEADER 2
+#define ADF_T_DATA 8
+#define ADF_T_LIST 16
+#define ADF_ST_ROOT 1
+#define ADF_ST_USERDIR 2
+#define ADF_ST_FILE -3
+
+/* longest member name of an LhA archive */
+#define LHA_MAX_NAME 512
+/* largest unpacked size of a packed LhA member, far above any module */
+#define LHA_MAX_SIZE 0x1000000L
+
+/* Huffman decoder of the -lh4- to -lh7- methods */
+#define LHA_NC 510      // literals and match lengths
+#define LHA_NT 19       // code lengths of the literal table
+#define LHA_NPT 32      // positions, enough for any 5 bit count
+#define LHA_CBIT 9
+#define LHA_TBIT 5
+
+/* walk through the directories of an ADF image */
+typedef struct {
+    char *in;
+    long blocks;
+    int ffs;
+    // header blocks already visited, against loops in broken images
+    unsigned char *seen;
+    char path[ADF_MAX_PATH];
+    member_func fn;
+    void *ctx;
+    long cnt;
+    int stop;
+} adf_walk;
+
+/* state of the LhA decoder */
+typedef struct {
+    unsigned char *src;
+    unsigned char *end;
+    unsigned int bitbuf;
+    unsigned int subbitbuf;
+    int bitcount;
+    unsigned int blocksize;
+    int np;
+    int pbit;
+    unsigned char c_len[LHA_NC];
+    unsigned char pt_len[LHA_NPT];
+    u16 c_table[4096];
+    u16 pt_table[256];
+    u16 left[2 * LHA_NC - 1];
+    u16 right[2 * LHA_NC - 1];
+    u16 crc_table[256];
+    char name[LHA_MAX_NAME];
+} lha_decoder;
+
+/* buffer for the members, grown as needed */
+typedef struct {
+    char *dat;
+    long max;
+} member_buf;
+
+/*
+ * get_le16 - Get a little-endian word, as used by LhA headers.
+ */
+long get_le16(unsigned char *p) {
+    return (long)p[0] | (long)p[1] << 8;
+}
+
+/*
+ * get_le32 - Get a little-endian long.
+ */
+long get_le32(unsigned char *p) {
+    return (long)((u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24);
+}
+
+/*
+ * grow_buf - Make sure the member buffer holds size bytes.
+ */
+char *grow_buf(member_buf *mb, long size) {
+    char *p;
+
+    if(size <= mb->max)
+        return mb->dat;
+
+    p = realloc(mb->dat, size);
+    if(p == NULL)
+        return NULL;
+
+    mb->dat = p;
+    mb->max = size;
+
+    return p;
+}
+
+/*
+ * container_type - Identify the container format of a buffer.
+ * Returns one of the CONTAINER_* values.
+ */
+int container_type(char *in, long in_size) {
+    unsigned char *p = (unsigned char *)in;
+
+    if(in_size >= ADF_BSIZE * 4 && in_size % ADF_BSIZE == 0
+        && memcmp(in, "DOS", 3) == 0 && p[3] <= 7)
+        return CONTAINER_ADF;
+
+    if(in_size >= 22 && p[2] == '-' && p[3] == 'l' && (p[4] == 'h' || p[4] == 'z')
+        && p[6] == '-' && p[20] <= 2)
+        return CONTAINER_LHA;
+
+    if(in_size >= 10 && memcmp(in, "LZX", 3) == 0)
+        return CONTAINER_LZX;
+
+    return CONTAINER_NONE;
+}
+
+/*
+ * container_name - Name of a container format for messages.
+ */
+char *container_name(int type) {
+    switch(type) {
+    case CONTAINER_ADF:
+        return "ADF";
+    case CONTAINER_LHA:
+        return "LhA";
+    case CONTAINER_LZX:
+        return "LZX";
+    }
+    return "plain";
+}
+
+/*
+ * adf_block - Address of block n, or NULL if outside the image.
+ */
+char *adf_block(adf_walk *w, long n) {
+    if(n <= 0 || n >= w->blocks)
+        return NULL;
+
+    return w->in + n * ADF_BSIZE;
+}
+
+/*
+ * adf_read_file - Gather the data blocks of the file with header block
+ * hdr into buf. Returns 0, or -1 if the block lists are broken.
+ */
+int adf_read_file(adf_walk *w, char *hdr, char *buf, long size) {
+    char *blk = hdr;
+    char *dat;
+    char *src;
+    long pos = 0;
+    long lists = 0;
+    long cnt;
+    long len;
+    long i;
+
+    while(blk != NULL && pos < size) {
+        cnt = get_long(blk + 8);
+        if(cnt < 0 || cnt > ADF_HT_SIZE)
+            return -1;
+
+        // The data block table is filled from its end
+        for(i = 0; i < cnt && pos < size; i++) {
+            dat = adf_block(w, get_long(blk + 24 + (ADF_HT_SIZE - 1 - i) * 4));
+            if(dat == NULL)
+                return -1;
+
+            if(w->ffs) {
+                src = dat;
+                len = ADF_BSIZE;
+            } else {
+                if(get_long(dat) != ADF_T_DATA)
+                    return -1;
+                src = dat + 24;
+                len = get_long(dat + 12);
+                if(len < 0 || len > ADF_OFS_DATA)
+                    return -1;
+            }
+            if(len > size - pos)
+                len = size - pos;
+
+            memcpy(buf + pos, src, len);
+            pos += len;
+        }
+
+        if(++lists > w->blocks)
+            return -1;
+
+        blk = adf_block(w, get_long(blk + ADF_BSIZE - 8));
+        if(blk != NULL && get_long(blk) != ADF_T_LIST)
+            return -1;
+    }
+
+    return pos == size ? 0 : -1;
+}
+
+/*
+ * adf_walk_dir - Hand every file below the directory block dir to the
+ * member function. path_len is the length of the directory's path.
+ */
+void adf_walk_dir(adf_walk *w, char *dir, long path_len, int depth, member_buf *mb) {
+    char *hdr;
+    char *buf;
+    long key;
+    long size;
+    long len;
+    long sec;
+    int rc;
+    int i;
+
+    for(i = 0; i < ADF_HT_SIZE && !w->stop; i++) {
+        key = get_long(dir + 24 + i * 4);
+
+        while(key != 0 && !w->stop) {
+            hdr = adf_block(w, key);
+            if(hdr == NULL || w->seen[key] || get_long(hdr) != ADF_T_HEADER)
+                break;
+            w->seen[key] = 1;
+
+            len = (unsigned char)hdr[ADF_BSIZE - 80];
+            if(len > 30)
+                len = 30;
+            if(path_len + len + 2 > ADF_MAX_PATH)
+                break;
+            if(path_len > 0)
+                w->path[path_len] = '/';
+            memcpy(w->path + path_len + (path_len > 0), hdr + ADF_BSIZE - 79, len);
+            w->path[path_len + (path_len > 0) + len] = 0;
+
+            sec = get_long(hdr + ADF_BSIZE - 4);
+            if(sec == ADF_ST_FILE) {
+                size = get_long(hdr + ADF_BSIZE - 188);
+                buf = NULL;
+                if(size >= 0 && size <= w->blocks * ADF_BSIZE) {
+                    buf = grow_buf(mb, size > 0 ? size : 1);
+                    if(buf == NULL) {
+                        w->cnt = SONIC_ERR_MEMORY;
+                        w->stop = 1;
+                        return;
+                    }
+                    if(adf_read_file(w, hdr, buf, size) != 0)
+                        buf = NULL;
+                }
+
+                rc = w->fn(w->path, buf, buf != NULL ? size : SONIC_ERR_FORMAT, w->ctx);
+                w->cnt++;
+                if(rc != 0)
+                    w->stop = 1;
+            } else if(sec == ADF_ST_USERDIR && depth < ADF_MAX_DEPTH) {
+                adf_walk_dir(w, hdr, path_len + (path_len > 0) + len, depth + 1, mb);
+            }
+
+            key = get_long(hdr + ADF_BSIZE - 16);
+        }
+    }
+}
+
+/*
+ * adf_members - Walk an AmigaDOS disk image.
+ */
+long adf_members(char *in, long in_size, member_func fn, void *ctx, arena *a, member_buf *mb) {
+    adf_walk *w;
+    char *root;
+
+    w = arena_alloc(a, sizeof(adf_walk));
+    if(w == NULL)
+        return SONIC_ERR_MEMORY;
+
+    w->in = in;
+    w->blocks = in_size / ADF_BSIZE;
+    w->ffs = in[3] & 1;
+    w->fn = fn;
+    w->ctx = ctx;
+    w->cnt = 0;
+    w->stop = 0;
+    w->path[0] = 0;
+
+    root = adf_block(w, w->blocks / 2);
+    if(root == NULL || get_long(root) != ADF_T_HEADER || get_long(root + ADF_BSIZE - 4) != ADF_ST_ROOT)
+        return SONIC_ERR_FORMAT;
+
+    w->seen = arena_alloc(a, w->blocks);
+    if(w->seen == NULL)
+        return SONIC_ERR_MEMORY;
+    memset(w->seen, 0, w->blocks);
+
+    adf_walk_dir(w, root, 0, 0, mb);
+
+    return w->cnt;
+}
+
+/*
+ * lha_fill - Shift n bits out of the bit buffer and refill it.
+ * Past the end of the packed data, zero bits are read.
+ */
+void lha_fill(lha_decoder *d, int n) {
+    d->bitbuf = (d->bitbuf << n) & 0xffff;
+    while(n > d->bitcount) {
+        n -= d->bitcount;
+        d->bitbuf |= (d->subbitbuf << n) & 0xffff;
+        d->subbitbuf = d->src < d->end ? *d->src++ : 0;
+        d->bitcount = 8;
+    }
+    d->bitcount -= n;
+    d->bitbuf |= d->subbitbuf >> d->bitcount;
+}
+
+/*
+ * lha_bits - Read n bits, n at most 16.
+ */
+unsigned int lha_bits(lha_decoder *d, int n) {
+    unsigned int x;
+
+    if(n == 0)
+        return 0;
+
+    x = d->bitbuf >> (16 - n);
+    lha_fill(d, n);
+
+    return x;
+}
+
+/*
+ * lha_make_table - Build the lookup table of a canonical Huffman code
+ * from its code lengths. Codes longer than bits continue as a tree in
+ * left and right. Returns -1 if the lengths are no complete code.
+ */
+int lha_make_table(lha_decoder *d, int nchar, unsigned char *bitlen, int bits, u16 *table) {
+    unsigned long count[17];
+    unsigned long weight[17];
+    unsigned long start[18];
+    unsigned long nextcode;
+    unsigned long k;
+    unsigned long mask;
+    unsigned long i;
+    int jutbits;
+    int avail;
+    int len;
+    int ch;
+    u16 *p;
+
+    for(i = 1; i <= 16; i++)
+        count[i] = 0;
+    for(ch = 0; ch < nchar; ch++) {
+        if(bitlen[ch] > 16)
+            return -1;
+        count[bitlen[ch]]++;
+    }
+
+    start[1] = 0;
+    for(i = 1; i <= 16; i++)
+        start[i + 1] = start[i] + (count[i] << (16 - i));
+    if(start[17] != 0x10000)
+        return -1;
+
+    jutbits = 16 - bits;
+    for(i = 1; i <= (unsigned long)bits; i++) {
+        start[i] >>= jutbits;
+        weight[i] = 1UL << (bits - i);
+    }
+    for(; i <= 16; i++)
+        weight[i] = 1UL << (16 - i);
+
+    for(i = start[bits + 1] >> jutbits; i < 1UL << bits; i++)
+        table[i] = 0;
+
+    avail = nchar;
+    mask = 1UL << (15 - bits);
+    for(ch = 0; ch < nchar; ch++) {
+        len = bitlen[ch];
+        if(len == 0)
+            continue;
+
+        nextcode = start[len] + weight[len];
+        if(len <= bits) {
+            for(i = start[len]; i < nextcode; i++)
+                table[i] = (u16)ch;
+        } else {
+            k = start[len];
+            p = &table[k >> jutbits];
+            for(i = len - bits; i != 0; i--) {
+                if(*p == 0) {
+                    if(avail >= 2 * LHA_NC - 1)
+                        return -1;
+                    d->left[avail] = d->right[avail] = 0;
+                    *p = (u16)avail++;
+                }
+                p = (k & mask) ? &d->right[*p] : &d->left[*p];
+                k <<= 1;
+            }
+            *p = (u16)ch;
+        }
+        start[len] = nextcode;
+    }
+
+    return 0;
+}
+
+/*
+ * lha_read_pt_len - Read the code lengths of the position table or of
+ * the table the literal code lengths are coded with.
+ */
+int lha_read_pt_len(lha_decoder *d, int nn, int nbit, int special) {
+    unsigned int mask;
+    int n;
+    int c;
+    int i;
+
+    n = lha_bits(d, nbit);
+    if(n == 0) {
+        c = lha_bits(d, nbit);
+        if(c >= nn)
+            return -1;
+        memset(d->pt_len, 0, nn);
+        for(i = 0; i < 256; i++)
+            d->pt_table[i] = (u16)c;
+        return 0;
+    }
+    if(n > nn)
+        return -1;
+
+    i = 0;
+    while(i < n) {
+        c = d->bitbuf >> 13;
+        if(c == 7) {
+            for(mask = 1U << 12; mask & d->bitbuf; mask >>= 1)
+                c++;
+            if(c > 16)
+                return -1;
+        }
+        lha_fill(d, c < 7 ? 3 : c - 3);
+        d->pt_len[i++] = (unsigned char)c;
+
+        if(i == special) {
+            for(c = lha_bits(d, 2); c > 0 && i < nn; c--)
+                d->pt_len[i++] = 0;
+        }
+    }
+    while(i < nn)
+        d->pt_len[i++] = 0;
+
+    return lha_make_table(d, nn, d->pt_len, 8, d->pt_table);
+}
+
+/*
+ * lha_read_c_len - Read the code lengths of the literal table.
+ */
+int lha_read_c_len(lha_decoder *d) {
+    unsigned int mask;
+    int n;
+    int c;
+    int i;
+
+    n = lha_bits(d, LHA_CBIT);
+    if(n == 0) {
+        c = lha_bits(d, LHA_CBIT);
+        if(c >= LHA_NC)
+            return -1;
+        memset(d->c_len, 0, LHA_NC);
+        for(i = 0; i < 4096; i++)
+            d->c_table[i] = (u16)c;
+        return 0;
+    }
+    if(n > LHA_NC)
+        return -1;
+
+    i = 0;
+    while(i < n) {
+        c = d->pt_table[d->bitbuf >> 8];
+        for(mask = 1U << 7; c >= LHA_NT; mask >>= 1)
+            c = (d->bitbuf & mask) ? d->right[c] : d->left[c];
+        lha_fill(d, d->pt_len[c]);
+
+        if(c <= 2) {
+            if(c == 0)
+                c = 1;
+            else if(c == 1)
+                c = lha_bits(d, 4) + 3;
+            else
+                c = lha_bits(d, LHA_CBIT) + 20;
+            while(c-- > 0 && i < LHA_NC)
+                d->c_len[i++] = 0;
+        } else {
+            d->c_len[i++] = (unsigned char)(c - 2);
+        }
+    }
+    while(i < LHA_NC)
+        d->c_len[i++] = 0;
+
+    return lha_make_table(d, LHA_NC, d->c_len, 12, d->c_table);
+}
+
+/*
+ * lha_decode_c - Decode a literal (below 256) or a match length.
+ * Returns -1 if the tables of a new block are broken.
+ */
+int lha_decode_c(lha_decoder *d) {
+    unsigned int mask;
+    int j;
+
+    if(d->blocksize == 0) {
+        d->blocksize = lha_bits(d, 16);
+        if(lha_read_pt_len(d, LHA_NT, LHA_TBIT, 3) != 0
+            || lha_read_c_len(d) != 0
+            || lha_read_pt_len(d, d->np, d->pbit, -1) != 0)
+            return -1;
+    }
+    d->blocksize--;
+
+    j = d->c_table[d->bitbuf >> 4];
+    for(mask = 1U << 3; j >= LHA_NC; mask >>= 1)
+        j = (d->bitbuf & mask) ? d->right[j] : d->left[j];
+    lha_fill(d, d->c_len[j]);
+
+    return j;
+}
+
+/*
+ * lha_decode_p - Decode the distance of a match, minus one.
+ */
+long lha_decode_p(lha_decoder *d) {
+    unsigned int mask;
+    long j;
+
+    j = d->pt_table[d->bitbuf >> 8];
+    for(mask = 1U << 7; j >= d->np; mask >>= 1)
+        j = (d->bitbuf & mask) ? d->right[j] : d->left[j];
+    lha_fill(d, d->pt_len[j]);
+
+    if(j != 0)
+        j = (1L << (j - 1)) + lha_bits(d, (int)(j - 1));
+
+    return j;
+}
+
+/*
+ * lha_decode - Unpack size bytes of an -lh4- to -lh7- member to out.
+ * Returns 0, or -1 if the data is broken.
+ */
+int lha_decode(lha_decoder *d, unsigned char *src, long src_len, unsigned char *out, long size) {
+    long pos = 0;
+    long from;
+    long len;
+    int c;
+
+    d->src = src;
+    d->end = src + src_len;
+    d->bitbuf = 0;
+    d->subbitbuf = 0;
+    d->bitcount = 0;
+    d->blocksize = 0;
+    lha_fill(d, 16);
+
+    while(pos < size) {
+        c = lha_decode_c(d);
+        if(c < 0)
+            return -1;
+
+        if(c < 256) {
+            out[pos++] = (unsigned char)c;
+            continue;
+        }
+
+        len = c - 253;
+        from = pos - lha_decode_p(d) - 1;
+        if(len > size - pos)
+            len = size - pos;
+
+        // The dictionary starts out filled with spaces
+        for(; len > 0; len--, from++)
+            out[pos++] = from >= 0 ? out[from] : ' ';
+    }
+
+    return 0;
+}
+
+/*
+ * lha_crc - CRC-16 of the unpacked data, as stored in the header.
+ */
+long lha_crc(lha_decoder *d, unsigned char *p, long len) {
+    unsigned int crc = 0;
+
+    while(len-- > 0)
+        crc = d->crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+/*
+ * lha_add_name - Append name bytes to the member name, with all kinds
+ * of directory separators turned into '/'.
+ */
+void lha_add_name(char *name, unsigned char *p, long len) {
+    long pos = strlen(name);
+
+    for(; len > 0 && pos < LHA_MAX_NAME - 1; len--, p++)
+        name[pos++] = (*p == 0xff || *p == '\\') ? '/' : (char)*p;
+    name[pos] = 0;
+}
+
+/*
+ * lha_members - Walk an LhA archive.
+ */
+long lha_members(char *in, long in_size, member_func fn, void *ctx, arena *a, member_buf *mb) {
+    lha_decoder *d;
+    unsigned char *h;
+    unsigned char *ext;
+    unsigned char *name;
+    unsigned char *dir;
+    unsigned char *buf;
+    long name_len;
+    long dir_len;
+    long pos = 0;
+    long cnt = 0;
+    long hsize;
+    long packed;
+    long size;
+    long next;
+    long crc;
+    long dat;
+    long err;
+    int level;
+    int method;
+    unsigned int c;
+    int i;
+
+    d = arena_alloc(a, sizeof(lha_decoder));
+    if(d == NULL)
+        return SONIC_ERR_MEMORY;
+
+    for(i = 0; i < 256; i++) {
+        c = i;
+        for(method = 0; method < 8; method++)
+            c = (c & 1) ? (c >> 1) ^ 0xa001 : c >> 1;
+        d->crc_table[i] = (u16)c;
+    }
+
+    while(pos + 22 <= in_size && in[pos] != 0) {
+        h = (unsigned char *)in + pos;
+        if(h[2] != '-' || h[6] != '-')
+            return cnt > 0 ? cnt : SONIC_ERR_FORMAT;
+
+        level = h[20];
+        packed = get_le32(h + 7);
+        size = get_le32(h + 11);
+
+        if(level == 0 || level == 1) {
+            hsize = h[0] + 2;
+            if(hsize < 24 + h[21] || pos + hsize > in_size)
+                return SONIC_ERR_FORMAT;
+            crc = get_le16(h + 22 + h[21]);
+            dat = pos + hsize;
+            next = level == 1 ? get_le16(h + hsize - 2) : 0;
+        } else if(level == 2) {
+            hsize = get_le16(h);
+            if(hsize < 26 || pos + hsize > in_size)
+                return SONIC_ERR_FORMAT;
+            crc = get_le16(h + 21);
+            dat = pos + hsize;
+            next = get_le16(h + 24);
+        } else {
+            return SONIC_ERR_FORMAT;
+        }
+
+        // Extended headers follow the base header. On level 1 they are
+        // counted in the packed size, on level 2 in the header size.
+        ext = h + (level == 2 ? 26 : hsize);
+        name = level == 2 ? NULL : h + 22;
+        name_len = level == 2 ? 0 : h[21];
+        dir = NULL;
+        dir_len = 0;
+        while(next != 0) {
+            if(next < 3 || ext + next > (unsigned char *)in + in_size)
+                return SONIC_ERR_FORMAT;
+            if(ext[0] == 1) {
+                name = ext + 1;
+                name_len = next - 3;
+            } else if(ext[0] == 2) {
+                dir = ext + 1;
+                dir_len = next - 3;
+            }
+            if(level == 1) {
+                packed -= next;
+                dat += next;
+            }
+            ext += next;
+            next = get_le16(ext - 2);
+        }
+
+        d->name[0] = 0;
+        if(dir != NULL) {
+            lha_add_name(d->name, dir, dir_len);
+            if(d->name[0] && d->name[strlen(d->name) - 1] != '/')
+                lha_add_name(d->name, (unsigned char *)"/", 1);
+        }
+        if(name != NULL)
+            lha_add_name(d->name, name, name_len);
+
+        if(packed < 0 || size < 0 || packed > in_size - dat)
+            return cnt > 0 ? cnt : SONIC_ERR_FORMAT;
+
+        method = h[5];
+        err = 0;
+        buf = NULL;
+        if(h[4] == 'h' && method == 'd') {
+            // directory entry
+            pos = dat + packed;
+            continue;
+        } else if((h[4] == 'h' && method == '0') || (h[4] == 'z' && method == '4')) {
+            // stored, -lh0- or -lz4- (-lzs- is LArc LZSS, not supported)
+            if(packed == size)
+                buf = h + (dat - pos);
+            else
+                err = SONIC_ERR_FORMAT;
+        } else if(h[4] == 'h' && method >= '4' && method <= '7' && size > LHA_MAX_SIZE) {
+            // The size is taken from the header, do not trust it blindly
+            err = SONIC_ERR_FORMAT;
+        } else if(h[4] == 'h' && method >= '4' && method <= '7') {
+            buf = (unsigned char *)grow_buf(mb, size > 0 ? size : 1);
+            if(buf == NULL)
+                return SONIC_ERR_MEMORY;
+
+            d->np = method <= '5' ? 14 : method == '6' ? 16 : 17;
+            d->pbit = method <= '5' ? 4 : 5;
+            if(lha_decode(d, (unsigned char *)in + dat, packed, buf, size) != 0)
+                err = SONIC_ERR_FORMAT;
+        } else {
+            err = SONIC_ERR_FORMAT;
+        }
+
+        if(err == 0 && lha_crc(d, buf, size) != crc)
+            err = SONIC_ERR_FORMAT;
+
+        cnt++;
+        if(fn(d->name, err == 0 ? (char *)buf : NULL, err == 0 ? size : err, ctx) != 0)
+            break;
+
+        pos = dat + packed;
+    }
+
+    return cnt;
+}
+
+/*
+ * container_members - Call fn for every member of the container in the
+ * input, with the member's name and data. Members that cannot be
+ * unpacked are passed with data NULL and an error code as size. The
+ * data is only valid during the call. A nonzero return of fn stops
+ * the walk. Returns the number of members, SONIC_ERR_FORMAT for
+ * unsupported or damaged containers or SONIC_ERR_MEMORY.
+ */
+long container_members(char *in, long in_size, member_func fn, void *ctx, arena *a) {
+    member_buf mb;
+    long rc;
+
+    mb.dat = NULL;
+    mb.max = 0;
+
+    switch(container_type(in, in_size)) {
+    case CONTAINER_ADF:
+        rc = adf_members(in, in_size, fn, ctx, a, &mb);
+        break;
+    case CONTAINER_LHA:
+        rc = lha_members(in, in_size, fn, ctx, a, &mb);
+        break;
+    default:
+        rc = SONIC_ERR_FORMAT;
+        break;
+    }
+
+    free(mb.dat);
+
+    return rc;
+}
@@ -0,0 +1,903 @@
+/*
+ * SonicArranger packed format converter - conversion library
+ *
+ * Finds a packed SonicArranger module in a buffer and converts it to
+ * the SOAR format in memory. Used by the sonicconv tool and usable on
+ * its own, e.g. for services that receive modules over the network.
+ *
+ * by Thomas Meyer <mnemotron@gmail.com>
+ * Created: 2026-10-14
+ * Last change: 2026-10-14
+ *
+ * Format references:
+ * http://old.exotica.org.uk/tunes/formats/sonic/SONIC_AR.TXT
+ * https://github.com/Pyrdacor/SonicArranger/blob/main/Docs/PackedFileFormat.md
+ *
+ * Written with SAS/C 6.5.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sonicconv.h"
+
+/* smallest block an arena allocates */
+#define ARENA_MIN_BLOCK 0x4000
+
+char SOAR_ID [] = "SOARV1.0";
+char STBL_ID [] = "STBL";
+char OVTB_ID [] = "OVTB";
+char NTBL_ID [] = "NTBL";
+char INST_ID [] = "INST";
+char SD8B_ID [] = "SD8B";
+char SYWT_ID [] = "SYWT";
+char SYAR_ID [] = "SYAR";
+char SYAF_ID [] = "SYAF";
+char EDAT_ID [] = "EDATV1.1";
+char EDAT_DATA [] = { 0, 1, 0, 1, 0, 0, 0, 0x7b, 0, 0, 0, 0, 0, 1, 0, 3 };
+
+/*
+ * arena_init - Set up an empty arena.
+ */
+void arena_init(arena *a) {
+    a->head = NULL;
+}
+
+/*
+ * arena_new_block - Put a new block of at least size bytes in front.
+ */
+arena_block *arena_new_block(arena *a, long size) {
+    arena_block *blk;
+
+    if(size < ARENA_MIN_BLOCK)
+        size = ARENA_MIN_BLOCK;
+
+    blk = malloc(sizeof(arena_block) + size);
+    if(blk == NULL)
+        return NULL;
+
+    blk->next = a->head;
+    blk->size = size;
+    blk->used = 0;
+    a->head = blk;
+
+    return blk;
+}
+
+/*
+ * arena_alloc - Allocate size bytes from the arena, aligned to 8 bytes.
+ * Returns NULL if no memory is left.
+ */
+void *arena_alloc(arena *a, long size) {
+    arena_block *blk;
+    void *p;
+
+    size = (size + 7) & ~7L;
+
+    blk = a->head;
+    if(blk == NULL || blk->size - blk->used < size) {
+        // Grow geometrically, so a batch run needs few blocks
+        blk = arena_new_block(a, blk != NULL && blk->size * 2 > size ? blk->size * 2 : size);
+        if(blk == NULL)
+            return NULL;
+    }
+
+    p = (char *)(blk + 1) + blk->used;
+    blk->used += size;
+
+    return p;
+}
+
+/*
+ * arena_reset - Release all allocations of the arena.
+ * If more than one block was needed, they are replaced by a single
+ * block of their total size, so the arena settles on one block that
+ * fits the largest conversion.
+ */
+void arena_reset(arena *a) {
+    arena_block *blk;
+    long total = 0;
+
+    if(a->head == NULL)
+        return;
+
+    if(a->head->next == NULL) {
+        a->head->used = 0;
+        return;
+    }
+
+    for(blk = a->head; blk != NULL; blk = blk->next)
+        total += blk->size;
+
+    arena_free(a);
+    arena_new_block(a, total);
+}
+
+/*
+ * arena_free - Give all memory of the arena back to the system.
+ */
+void arena_free(arena *a) {
+    arena_block *blk;
+
+    while(a->head != NULL) {
+        blk = a->head;
+        a->head = blk->next;
+        free(blk);
+    }
+}
+
+/*
+ * match_song - Check for the song data header at p.
+ * We assume that offset 0x28 and a slightly larger value after that
+ * is the beginning of the song data. Both are big-endian longs.
+ */
+int match_song(unsigned char *p) {
+    long v1, v2;
+
+    v1 = get_long((char *)p);
+    v2 = get_long((char *)p + 4);
+
+    return v1 == 0x28 && v2 > v1 && v2 < 0x400;
+}
+
+/*
+ * findsong_scalar - Search for the song data two bytes at a time,
+ * starting at offset.
+ */
+long findsong_scalar(char *data, long size, long offset) {
+    long max_offset;
+
+    max_offset = size - 0x28;
+    for(; offset < max_offset; offset += 2) {
+        if(data[offset + 3] == 0x28 && match_song((unsigned char *)data + offset))
+            return offset;
+    }
+
+    return -1;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define HAVE_FINDSONG_SSE2
+#define HAVE_FINDSONG_AVX2
+#include <immintrin.h>
+
+/*
+ * findsong_sse2 - Test 16 offsets per step for the bytes 00 00 00 28.
+ * Only the even offsets matching that pattern are validated by
+ * match_song(), the rest of the buffer is never looked at in scalar.
+ */
+long findsong_sse2(char *data, long size) {
+    long offset;
+    long max_offset;
+    __m128i zero, id, lo, hi;
+    unsigned long z, t, cand;
+    int bit;
+
+    zero = _mm_setzero_si128();
+    id = _mm_set1_epi8(0x28);
+    max_offset = size - 0x28;
+
+    // Candidates offset..offset + 15 need bytes up to offset + 18
+    for(offset = 0; offset + 16 <= max_offset; offset += 16) {
+        lo = _mm_loadu_si128((__m128i *)(data + offset));
+        hi = _mm_loadu_si128((__m128i *)(data + offset + 16));
+        t = (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, id))
+            | ((unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, id)) << 16);
+        if((t & 0x7fff8) == 0)
+            continue;
+        z = (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, zero))
+            | ((unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, zero)) << 16);
+        cand = z & (z >> 1) & (z >> 2) & (t >> 3) & 0x5555;
+        while(cand) {
+            bit = __builtin_ctzl(cand);
+            if(match_song((unsigned char *)data + offset + bit))
+                return offset + bit;
+            cand &= cand - 1;
+        }
+    }
+
+    return findsong_scalar(data, size, offset);
+}
+
+/*
+ * findsong_avx2 - Same as findsong_sse2(), 32 offsets per step.
+ */
+__attribute__((target("avx2")))
+long findsong_avx2(char *data, long size) {
+    long offset;
+    long max_offset;
+    __m256i zero, id, lo, hi;
+    unsigned long long z, t, cand;
+    int bit;
+
+    zero = _mm256_setzero_si256();
+    id = _mm256_set1_epi8(0x28);
+    max_offset = size - 0x28;
+
+    for(offset = 0; offset + 32 <= max_offset; offset += 32) {
+        lo = _mm256_loadu_si256((__m256i *)(data + offset));
+        hi = _mm256_loadu_si256((__m256i *)(data + offset + 32));
+        t = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, id))
+            | ((unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, id)) << 32);
+        if((t & 0x7fffffff8ULL) == 0)
+            continue;
+        z = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero))
+            | ((unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero)) << 32);
+        cand = z & (z >> 1) & (z >> 2) & (t >> 3) & 0x55555555ULL;
+        while(cand) {
+            bit = __builtin_ctzll(cand);
+            if(match_song((unsigned char *)data + offset + bit))
+                return offset + bit;
+            cand &= cand - 1;
+        }
+    }
+
+    return findsong_scalar(data, size, offset);
+}
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define HAVE_FINDSONG_NEON
+#include <arm_neon.h>
+
+/*
+ * findsong_neon - Test 16 offsets per step for the bytes 00 00 00 28.
+ */
+long findsong_neon(char *data, long size) {
+    static const unsigned char even[16] = {
+        0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0
+    };
+    long offset;
+    long max_offset;
+    uint8x16_t lo, hi, z_lo, z_hi, t_lo, t_hi, cand, mask;
+    int i;
+
+    mask = vld1q_u8(even);
+    max_offset = size - 0x28;
+
+    for(offset = 0; offset + 16 <= max_offset; offset += 16) {
+        lo = vld1q_u8((unsigned char *)data + offset);
+        hi = vld1q_u8((unsigned char *)data + offset + 16);
+        t_lo = vceqq_u8(lo, vdupq_n_u8(0x28));
+        t_hi = vceqq_u8(hi, vdupq_n_u8(0x28));
+        cand = vandq_u8(vextq_u8(t_lo, t_hi, 3), mask);
+        if(vmaxvq_u8(cand) == 0)
+            continue;
+        z_lo = vceqq_u8(lo, vdupq_n_u8(0));
+        z_hi = vceqq_u8(hi, vdupq_n_u8(0));
+        cand = vandq_u8(cand, z_lo);
+        cand = vandq_u8(cand, vextq_u8(z_lo, z_hi, 1));
+        cand = vandq_u8(cand, vextq_u8(z_lo, z_hi, 2));
+        if(vmaxvq_u8(cand) == 0)
+            continue;
+        for(i = 0; i < 16; i += 2) {
+            if(match_song((unsigned char *)data + offset + i))
+                return offset + i;
+        }
+    }
+
+    return findsong_scalar(data, size, offset);
+}
+#endif
+
+#if defined(__SASC) && defined(SONIC_ASM)
+#define HAVE_FINDSONG_68K
+
+/* in findsong.a */
+long __asm findsong_68k(register __a0 char *data, register __d0 long cnt);
+
+/*
+ * findsong_asm - Let the assembly loop find the bytes 00 00 00 28 and
+ * validate its hits with match_song().
+ */
+long findsong_asm(char *data, long size) {
+    long offset = 0;
+    long hit;
+
+    // The 68000 cannot read words at odd addresses
+    if((long)data & 1)
+        return findsong_scalar(data, size, 0);
+
+    while(offset < size - 0x28) {
+        hit = findsong_68k(data + offset, (size - 0x28 - offset + 1) / 2);
+        if(hit < 0)
+            return -1;
+        offset += hit;
+        if(match_song((unsigned char *)data + offset))
+            return offset;
+        offset += 2;
+    }
+
+    return -1;
+}
+#endif
+
+/*
+ * findsong_plain - Scalar scan of the whole buffer.
+ */
+long findsong_plain(char *data, long size) {
+    return findsong_scalar(data, size, 0);
+}
+
+/*
+ * findsong - Find the offset off the song data.
+ * Uses the fastest scanner the CPU supports, which is picked on the
+ * first call.
+ */
+long findsong(char *data, long size) {
+    static long (*picked)(char *, long) = NULL;
+    long (*scan)(char *, long);
+
+    // Threads may race to pick, but they all store the same function
+#if defined(__GNUC__)
+    scan = __atomic_load_n(&picked, __ATOMIC_RELAXED);
+#else
+    scan = picked;
+#endif
+
+    if(scan == NULL) {
+#if defined(HAVE_FINDSONG_AVX2)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            scan = findsong_avx2;
+        else
+            scan = findsong_sse2;
+#elif defined(HAVE_FINDSONG_NEON)
+        scan = findsong_neon;
+#elif defined(HAVE_FINDSONG_68K)
+        scan = findsong_asm;
+#else
+        scan = findsong_plain;
+#endif
+#if defined(__GNUC__)
+        __atomic_store_n(&picked, scan, __ATOMIC_RELAXED);
+#else
+        picked = scan;
+#endif
+    }
+
+    return scan(data, size);
+}
+
+/*
+ * put_chunk - Store a chunk ID and its entry count at p.
+ * Returns the position after them.
+ */
+char *put_chunk(char *p, char *id, long cnt) {
+    memcpy(p, id, 4);
+    put_long(p + 4, cnt);
+    return p + 8;
+}
+
+/*
+ * parse_section - Fill a section from its start and end offset.
+ */
+void parse_section(module_section *sec, long start, long end, long entry_size) {
+    sec->offset = start;
+    sec->len = end - start;
+    sec->cnt = sec->len / entry_size;
+}
+
+/*
+ * check_module - Cheap plausibility check of a findsong() hit, before
+ * anything is allocated: the sections must follow each other inside
+ * the input, hold whole entries, and the sample table and sample data
+ * must fit in the input. Sample ids of sampled instruments above
+ * MAX_SAMPLE_ID only come from random data. Smaller ones that are out
+ * of range are left to parse_module(), which ignores them.
+ * Returns 0 or SONIC_ERR_NOT_FOUND.
+ */
+int check_module(char *in, long in_size, long *sections) {
+    static long entry_size[7] = { 12, 16, 4, 0x98, 128, 128, 128 };
+    long sample_cnt;
+    long free_len;
+    long s_len;
+    long i;
+    char *instr;
+
+    if(sections[0] < 0)
+        return SONIC_ERR_NOT_FOUND;
+    for(i = 0; i < 7; i++) {
+        if(sections[i + 1] < sections[i] || (sections[i + 1] - sections[i]) % entry_size[i] != 0)
+            return SONIC_ERR_NOT_FOUND;
+    }
+    if(sections[7] > in_size - 4)
+        return SONIC_ERR_NOT_FOUND;
+
+    sample_cnt = get_long(in + sections[7]);
+    free_len = in_size - sections[7] - 4;
+    if(sample_cnt < 0 || sample_cnt > free_len / 4)
+        return SONIC_ERR_NOT_FOUND;
+
+    free_len -= sample_cnt * 4;
+    for(i = 0; i < sample_cnt; i++) {
+        s_len = get_long(in + sections[7] + 4 + i * 4);
+        if(s_len < 0 || s_len > free_len)
+            return SONIC_ERR_NOT_FOUND;
+        free_len -= s_len;
+    }
+
+    instr = in + sections[3];
+    for(; instr < in + sections[4]; instr += 0x98) {
+        if(get_word(instr) == 0 && get_word(instr + 2) > MAX_SAMPLE_ID)
+            return SONIC_ERR_NOT_FOUND;
+    }
+
+    return 0;
+}
+
+/*
+ * parse_module - Build the layout of the module at offset in the input.
+ * The sample info table is allocated from the arena. Without an arena
+ * only the sections are filled in and samples is left NULL.
+ * Returns 0 or a negative SONIC_ERR_* code, SONIC_ERR_NOT_FOUND if
+ * check_module() rejects the module.
+ */
+int parse_module(char *in, long in_size, long offset, module_layout *ml, arena *a) {
+    long sections[8];
+    long i;
+    long s_len;
+    long sample_id;
+    char *instr;
+
+    memset(ml, 0, sizeof(module_layout));
+
+    if(offset < 0 || offset > in_size - 32)
+        return SONIC_ERR_NOT_FOUND;
+
+    ml->offset = offset;
+    for(i = 0; i < 8; i++) {
+        // Keep the sums in range, check_module() rejects them anyway
+        s_len = get_long(in + offset + i * 4);
+        sections[i] = s_len >= 0 && s_len <= in_size ? offset + s_len : -1;
+    }
+
+    if(check_module(in, in_size, sections) != 0)
+        return SONIC_ERR_NOT_FOUND;
+
+    parse_section(&ml->song, sections[0], sections[1], 12);
+    parse_section(&ml->over, sections[1], sections[2], 16);
+    parse_section(&ml->note, sections[2], sections[3], 4);
+    parse_section(&ml->instr, sections[3], sections[4], 152);
+    parse_section(&ml->wave, sections[4], sections[5], 128);
+    parse_section(&ml->adsr, sections[5], sections[6], 128);
+    parse_section(&ml->amf, sections[6], sections[7], 128);
+
+    // Sample section: number of samples, their lengths, sample data
+    ml->sample.offset = sections[7];
+    ml->sample.cnt = get_long(in + sections[7]);
+    ml->sample_data_offset = sections[7] + 4 + ml->sample.cnt * 4;
+    for(i = 0; i < ml->sample.cnt; i++)
+        ml->sample.len += get_long(in + sections[7] + 4 + i * 4);
+
+    if(a == NULL)
+        return 0;
+
+    ml->samples = arena_alloc(a, ml->sample.cnt * sizeof(sample_info));
+    if(ml->samples == NULL)
+        return SONIC_ERR_MEMORY;
+    memset(ml->samples, 0, ml->sample.cnt * sizeof(sample_info));
+
+    for(i = 0; i < ml->sample.cnt; i++) {
+        s_len = get_long(in + sections[7] + 4 + i * 4);
+        ml->samples[i].length = s_len;
+    }
+
+    // Gather info for samples from instrument entries
+    instr = in + ml->instr.offset;
+    for(i = 0; i < ml->instr.cnt; i++, instr += 0x98) {
+        if(get_word(instr) != 0)
+            continue;
+        // is sampled instrument
+        sample_id = get_word(instr + 2);
+        if(sample_id < ml->sample.cnt) {
+            ml->samples[sample_id].length_from_instr = get_word(instr + 4);
+            ml->samples[sample_id].repeat_from_instr = get_word(instr + 6);
+            ml->samples[sample_id].name_from_instr = instr + 0x7a;
+        }
+        else
+            ml->bad_sample_ids++;
+    }
+
+    return 0;
+}
+
+/*
+ * find_module_from - Find the next module in the input at or after
+ * start and build its layout. Hits that fail check_module() are
+ * skipped and the search goes on right behind them, their number is
+ * left in ml->rejected.
+ * Returns the module offset or a negative SONIC_ERR_* code.
+ */
+long find_module_from(char *in, long in_size, long start, module_layout *ml, arena *a) {
+    long offset;
+    long rejected = 0;
+    int rc;
+
+    // Modules are word aligned
+    start = (start + 1) & ~1L;
+
+    for(;;) {
+        offset = start < in_size ? findsong(in + start, in_size - start) : -1;
+        if(offset < 0) {
+            ml->rejected = rejected;
+            return SONIC_ERR_NOT_FOUND;
+        }
+
+        offset += start;
+        rc = parse_module(in, in_size, offset, ml, a);
+        if(rc != SONIC_ERR_NOT_FOUND) {
+            ml->rejected = rejected;
+            return rc < 0 ? rc : offset;
+        }
+
+        rejected++;
+        start = offset + 2;
+    }
+}
+
+/*
+ * find_module - Find the first module in the input and build its layout.
+ * Returns the module offset or a negative SONIC_ERR_* code.
+ */
+long find_module(char *in, long in_size, module_layout *ml, arena *a) {
+    return find_module_from(in, in_size, 0, ml, a);
+}
+
+/*
+ * module_end - Offset after the module, where the search for another
+ * module can continue. Always behind the start of the module.
+ */
+long module_end(module_layout *ml) {
+    long end;
+
+    end = ml->sample_data_offset + ml->sample.len;
+
+    return end > ml->offset ? end : ml->offset + 2;
+}
+
+/*
+ * strip_module - Build a copy of the module without the instruments no
+ * note refers to and the samples only those use. A note names its
+ * instrument in its second byte, counted from 1 with 0 for none, and
+ * the sound transposes in the last byte of each voice in the over table
+ * move that number. An instrument is kept if a note reaches it with no
+ * transpose or any of those in use. The kept instruments and samples
+ * are renumbered in order and the notes changed to match, but if
+ * transposes are used only the instruments behind the last one reached
+ * are left out, as the transposed numbers must stay the same. Notes
+ * with a number above the instruments keep it.
+ * Returns the length of the copy stored at *out, allocated from the
+ * arena, 0 if nothing can be left out, or SONIC_ERR_MEMORY.
+ */
+long strip_module(char *in, module_layout *ml, char **out, arena *a) {
+    unsigned char noted[256];
+    unsigned char transposed[256];
+    unsigned char used[256];
+    // new number of each instrument, 0 if it is left out
+    unsigned char instr_map[256];
+    long *sample_map;
+    long instr_cnt = 0;
+    long sample_cnt = 0;
+    long sample_len = 0;
+    long max_instr;
+    long last = 0;
+    long head_len;
+    long len;
+    long s_len;
+    long pos;
+    long id;
+    long i;
+    int any_transpose = 0;
+    int n;
+    int s;
+    char *instr;
+    char *p;
+
+    // Numbers reached with and without the transposes in use
+    memset(noted, 0, sizeof(noted));
+    memset(transposed, 0, sizeof(transposed));
+    memset(used, 0, sizeof(used));
+    transposed[0] = 1;
+    for(i = 0; i < ml->over.cnt * 4; i++) {
+        s = (unsigned char)in[ml->over.offset + i * 4 + 3];
+        transposed[s] = 1;
+        any_transpose |= s != 0;
+    }
+    for(i = 0; i < ml->note.cnt; i++)
+        noted[(unsigned char)in[ml->note.offset + i * 4 + 1]] = 1;
+    for(n = 1; n < 256; n++) {
+        for(s = 0; noted[n] && s < 256; s++) {
+            if(transposed[s])
+                used[(n + s) & 0xff] = 1;
+        }
+    }
+
+    // Instruments above 255 cannot be reached at all
+    max_instr = ml->instr.cnt < 255 ? ml->instr.cnt : 255;
+    for(n = 1; n <= max_instr; n++) {
+        if(used[n])
+            last = n;
+    }
+
+    sample_map = arena_alloc(a, (ml->sample.cnt + 1) * sizeof(long));
+    if(sample_map == NULL)
+        return SONIC_ERR_MEMORY;
+    for(i = 0; i < ml->sample.cnt; i++)
+        sample_map[i] = -1;
+
+    memset(instr_map, 0, sizeof(instr_map));
+    for(n = 1; n <= max_instr; n++) {
+        if(!used[n] && !(any_transpose && n < last))
+            continue;
+        instr_map[n] = (unsigned char)++instr_cnt;
+        instr = in + ml->instr.offset + (n - 1) * 0x98;
+        id = get_word(instr + 2);
+        if(get_word(instr) == 0 && id < ml->sample.cnt)
+            sample_map[id] = 0;
+    }
+    for(i = 0; i < ml->sample.cnt; i++) {
+        if(sample_map[i] == 0) {
+            sample_map[i] = sample_cnt++;
+            sample_len += get_long(in + ml->sample.offset + 4 + i * 4);
+        }
+    }
+
+    if(instr_cnt == ml->instr.cnt && sample_cnt == ml->sample.cnt)
+        return 0;
+
+    head_len = ml->song.offset - ml->offset;
+    len = head_len + ml->song.len + ml->over.len + ml->note.len + instr_cnt * 0x98
+        + ml->wave.len + ml->adsr.len + ml->amf.len + 4 + sample_cnt * 4 + sample_len;
+    *out = arena_alloc(a, len);
+    if(*out == NULL)
+        return SONIC_ERR_MEMORY;
+
+    // Same header, the sections move up behind the instruments
+    p = *out;
+    memcpy(p, in + ml->offset, head_len);
+    put_long(p + 4, head_len + ml->song.len);
+    put_long(p + 8, head_len + ml->song.len + ml->over.len);
+    put_long(p + 12, head_len + ml->song.len + ml->over.len + ml->note.len);
+    put_long(p + 16, head_len + ml->song.len + ml->over.len + ml->note.len + instr_cnt * 0x98);
+    put_long(p + 20, get_long(p + 16) + ml->wave.len);
+    put_long(p + 24, get_long(p + 20) + ml->adsr.len);
+    put_long(p + 28, get_long(p + 24) + ml->amf.len);
+    p += head_len;
+
+    memcpy(p, in + ml->song.offset, ml->song.len + ml->over.len + ml->note.len);
+    p += ml->song.len + ml->over.len;
+    for(i = 0; i < ml->note.cnt; i++, p += 4) {
+        // Numbers above the instruments are kept, a transpose can
+        // still bring them back to one of them
+        n = (unsigned char)p[1];
+        if(n <= ml->instr.cnt)
+            p[1] = (char)instr_map[n];
+    }
+
+    for(n = 1; n <= max_instr; n++) {
+        if(instr_map[n] == 0)
+            continue;
+        instr = in + ml->instr.offset + (n - 1) * 0x98;
+        memcpy(p, instr, 0x98);
+        id = get_word(instr + 2);
+        if(get_word(instr) == 0 && id < ml->sample.cnt) {
+            p[2] = (char)(sample_map[id] >> 8);
+            p[3] = (char)sample_map[id];
+        }
+        p += 0x98;
+    }
+
+    memcpy(p, in + ml->wave.offset, ml->wave.len + ml->adsr.len + ml->amf.len);
+    p += ml->wave.len + ml->adsr.len + ml->amf.len;
+
+    put_long(p, sample_cnt);
+    p += 4;
+    for(i = 0; i < ml->sample.cnt; i++) {
+        if(sample_map[i] >= 0) {
+            put_long(p, get_long(in + ml->sample.offset + 4 + i * 4));
+            p += 4;
+        }
+    }
+    pos = ml->sample_data_offset;
+    for(i = 0; i < ml->sample.cnt; i++) {
+        s_len = get_long(in + ml->sample.offset + 4 + i * 4);
+        if(sample_map[i] >= 0) {
+            memcpy(p, in + pos, s_len);
+            p += s_len;
+        }
+        pos += s_len;
+    }
+
+    return len;
+}
+
+/*
+ * sonic_hash - Hash len bytes at p into two independent 32-bit values.
+ * Works on big-endian longs, so it is the same on every host and
+ * needs one multiplication per 4 bytes for each value.
+ */
+void sonic_hash(char *p, long len, u32 h[2]) {
+    u32 h0 = 0x811c9dc5UL;
+    u32 h1 = (u32)len;
+    u32 w;
+    long i;
+
+    for(i = 0; i + 4 <= len; i += 4) {
+        w = (u32)get_long(p + i);
+        h0 = (h0 ^ w) * 0x01000193UL;
+        h1 = (((h1 << 5) | (h1 >> 27)) ^ w) * 0x9e3779b1UL;
+    }
+    for(; i < len; i++) {
+        w = (unsigned char)p[i];
+        h0 = (h0 ^ w) * 0x01000193UL;
+        h1 = (((h1 << 5) | (h1 >> 27)) ^ w) * 0x9e3779b1UL;
+    }
+
+    // Final mix, so every input bit affects every output bit
+    h0 ^= h0 >> 16;
+    h0 *= 0x85ebca6bUL;
+    h0 ^= h0 >> 13;
+    h1 ^= h1 >> 16;
+    h1 *= 0xc2b2ae35UL;
+    h1 ^= h1 >> 13;
+
+    h[0] = h0;
+    h[1] = h1;
+}
+
+/*
+ * soar_head_size - Size of the chunk headers and sample tables that
+ * soar_pieces() builds in its head buffer.
+ */
+long soar_head_size(module_layout *ml) {
+    // SOAR ID, eight chunk headers, SD8B tables, EDAT chunk
+    return 8 + 8 * 8 + ml->sample.cnt * (4 + 4 + 30 + 4) + 8 + 0x10;
+}
+
+/*
+ * soar_output_size - Exact size of the converted module.
+ */
+long soar_output_size(module_layout *ml) {
+    return soar_head_size(ml)
+        + ml->song.len + ml->over.len + ml->note.len + ml->instr.len
+        + ml->sample.len + ml->wave.len + ml->adsr.len + ml->amf.len;
+}
+
+/*
+ * add_piece - Append a piece of data to the output list.
+ * Returns the new number of pieces.
+ */
+int add_piece(out_piece *pieces, int piece_cnt, char *base, long len) {
+    pieces[piece_cnt].base = base;
+    pieces[piece_cnt].len = len;
+    return piece_cnt + 1;
+}
+
+/*
+ * add_section - Append a chunk header stored at p and the section data.
+ * Returns the new number of pieces.
+ */
+int add_section(out_piece *pieces, int piece_cnt, char *p, char *id, char *in, module_section *sec) {
+    put_chunk(p, id, sec->cnt);
+    piece_cnt = add_piece(pieces, piece_cnt, p, 8);
+    return add_piece(pieces, piece_cnt, in + sec->offset, sec->len);
+}
+
+/*
+ * soar_pieces - Describe the SOAR output of a module as a list of
+ * pieces. Small fields are built in head, which must hold
+ * soar_head_size() bytes; section data is taken straight from the input.
+ * The layout needs its sample info table.
+ * Returns the number of pieces, at most MAX_PIECES.
+ */
+int soar_pieces(char *in, module_layout *ml, char *head, out_piece *pieces) {
+    int piece_cnt = 0;
+    char *p;
+    long i;
+
+    p = head;
+    memcpy(p, SOAR_ID, 8);
+    piece_cnt = add_piece(pieces, piece_cnt, p, 8);
+    p += 8;
+    piece_cnt = add_section(pieces, piece_cnt, p, STBL_ID, in, &ml->song);
+    p += 8;
+    piece_cnt = add_section(pieces, piece_cnt, p, OVTB_ID, in, &ml->over);
+    p += 8;
+    piece_cnt = add_section(pieces, piece_cnt, p, NTBL_ID, in, &ml->note);
+    p += 8;
+    piece_cnt = add_section(pieces, piece_cnt, p, INST_ID, in, &ml->instr);
+    p += 8;
+
+    piece_cnt = add_piece(pieces, piece_cnt, p, 8 + ml->sample.cnt * (4 + 4 + 30 + 4));
+    p = put_chunk(p, SD8B_ID, ml->sample.cnt);
+    // write lengths, repeats, names, lengths
+    for(i = 0; i < ml->sample.cnt; i++, p += 4)
+        put_long(p, ml->samples[i].length_from_instr);
+    for(i = 0; i < ml->sample.cnt; i++, p += 4)
+        put_long(p, ml->samples[i].repeat_from_instr);
+    for(i = 0; i < ml->sample.cnt; i++, p += 30) {
+        if(ml->samples[i].name_from_instr != NULL)
+            memcpy(p, ml->samples[i].name_from_instr, 30);
+        else
+            memset(p, 0, 30);
+    }
+    for(i = 0; i < ml->sample.cnt; i++, p += 4)
+        put_long(p, ml->samples[i].length);
+    piece_cnt = add_piece(pieces, piece_cnt, in + ml->sample_data_offset, ml->sample.len);
+
+    piece_cnt = add_section(pieces, piece_cnt, p, SYWT_ID, in, &ml->wave);
+    p += 8;
+    piece_cnt = add_section(pieces, piece_cnt, p, SYAR_ID, in, &ml->adsr);
+    p += 8;
+    piece_cnt = add_section(pieces, piece_cnt, p, SYAF_ID, in, &ml->amf);
+    p += 8;
+
+    memcpy(p, EDAT_ID, 8);
+    memcpy(p + 8, EDAT_DATA, 0x10);
+    piece_cnt = add_piece(pieces, piece_cnt, p, 8 + 0x10);
+
+    return piece_cnt;
+}
+
+/*
+ * sonic_output_size - Compute the exact size of the converted module.
+ * Returns the size in bytes or a negative SONIC_ERR_* code.
+ */
+long sonic_output_size(char *in, long in_size) {
+    module_layout ml;
+    long rc;
+
+    rc = find_module(in, in_size, &ml, NULL);
+    if(rc < 0)
+        return rc;
+
+    return soar_output_size(&ml);
+}
+
+/*
+ * sonic_convert - Convert the module in the input buffer into out.
+ * out must hold at least sonic_output_size() bytes. Scratch memory is
+ * taken from the arena; if a is NULL, a temporary one is used.
+ * Returns the number of bytes written or a negative SONIC_ERR_* code.
+ */
+long sonic_convert(char *in, long in_size, char *out, long out_size, arena *a) {
+    module_layout ml;
+    out_piece pieces[MAX_PIECES];
+    arena tmp;
+    char *head = NULL;
+    char *p;
+    long rc;
+    int piece_cnt;
+    int i;
+
+    if(a == NULL) {
+        arena_init(&tmp);
+        a = &tmp;
+    }
+
+    rc = find_module(in, in_size, &ml, a);
+    if(rc >= 0 && soar_output_size(&ml) > out_size)
+        rc = SONIC_ERR_BUFFER;
+
+    if(rc >= 0) {
+        head = arena_alloc(a, soar_head_size(&ml));
+        rc = SONIC_ERR_MEMORY;
+    }
+
+    if(head != NULL) {
+        piece_cnt = soar_pieces(in, &ml, head, pieces);
+
+        p = out;
+        for(i = 0; i < piece_cnt; i++) {
+            memcpy(p, pieces[i].base, pieces[i].len);
+            p += pieces[i].len;
+        }
+        rc = p - out;
+    }
+
+    if(a == &tmp)
+        arena_free(&tmp);
+
+    return rc;
+}
@@ -6,7 +6,7 @@
  *
  * by Thomas Meyer <mnemotron@gmail.com>
  * Created: 2022-06-02
- * Last change: 2022-06-03
+ * Last change: 2026-10-14
  *
  * Format references:
  * http://old.exotica.org.uk/tunes/formats/sonic/SONIC_AR.TXT
@@ -15,262 +15,4423 @@
  * This is not suppoed to be an example of good, structured programming.
  *
  * Written with SAS/C 6.5.
- * Compile with: sc sonicconv.c link
+ * Compile with: sc sonicconv.c soar.c container.c link programname=sonicconv
  */
 
 #include <sys/stat.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-/* struct for storing data per sample */
+#include "sonicconv.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_PTHREAD
+#define HAVE_MMAP
+#define HAVE_WRITEV
+#define HAVE_CLOCK_GETTIME
+#define HAVE_SOCKETS
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+#if defined(__SASC)
+#define HAVE_AMIGADOS
+#include <dos/dos.h>
+#include <exec/memory.h>
+#include <proto/dos.h>
+#include <proto/exec.h>
+#endif
+
+/* buffer the small pieces of an output file are gathered in */
+#define OUT_BUFFER 0x8000
+
+/* output file written through a buffer, see out_open() */
 typedef struct {
-    // length in bytes
-    long length;
-    // length in words
-    long length_from_instr;
-    // repeat in words
-    long repeat_from_instr;
-    // pointer to name entry in instrument table
-    char* name_from_instr;
-} sample_info;
-
-char SOAR_ID [] = "SOARV1.0";
-char STBL_ID [] = "STBL";
-char OVTB_ID [] = "OVTB";
-char NTBL_ID [] = "NTBL";
-char INST_ID [] = "INST";
-char SD8B_ID [] = "SD8B";
-char SYWT_ID [] = "SYWT";
-char SYAR_ID [] = "SYAR";
-char SYAF_ID [] = "SYAF";
-char EDAT_ID [] = "EDATV1.1";
-char EDAT_DATA [] = { 0, 1, 0, 1, 0, 0, 0, 0x7b, 0, 0, 0, 0, 0, 1, 0, 3 };
-
-/*
- * findsong - Find the offset off the song data.
- */
-long findsong(char *data, long size) {
+#ifdef HAVE_AMIGADOS
+    BPTR fh;
+#else
+    FILE *f;
+#endif
+    char *buf;
+    long size;
+    long len;
+    int to_stdout;
+    int failed;
+} out_file;
+
+/* first bytes of an archive written with -P, see pack_close() */
+#define PACK_ID "SPAKV1.0"
+
+/* conversion in an archive */
+typedef struct {
+    char *name;
     long offset;
-    long max_offset;
-    long *p1, *p2;
+    long len;
+    // module_hash() of the module
+    u32 hash[2];
+} pack_entry;
 
-    max_offset = size - 0x28;
-    for(offset = 0; offset < max_offset; offset += 2) {
-        p1 = (long *)(data + offset);
-        p2 = p1 + 1;
-        // We assume that offset 0x28 and a slightly larger value
-        // after that is the beginning of the song data.
-        if(*p1 == 0x28 && *p2 > *p1 && *p2 < 0x400)
-            return offset;
-    }
+/* archive the conversions of a batch are appended to, see pack_open() */
+typedef struct {
+    char *name;
+    out_file out;
+    // bytes written so far
+    long pos;
+    pack_entry *entries;
+    long cnt;
+    long max;
+} pack_file;
 
-    return -1;
-}
+/* conversion waiting to be written, see defer_module() */
+typedef struct pending_write {
+    struct pending_write *next;
+    char *out_name;
+    char *cache_file;
+    // archive to append to instead of writing out_name, or NULL
+    pack_file *pack;
+    u32 hash[2];
+    out_piece pieces[MAX_PIECES];
+    int piece_cnt;
+} pending_write;
+
+/* conversions of a file waiting to be written, in order */
+typedef struct {
+    pending_write *head;
+    pending_write **tail;
+} write_list;
+
+/* options for converting a file */
+typedef struct {
+    // convert every module found, not only the first one
+    int all;
+    // directory of already converted modules, or NULL
+    char *cache_dir;
+    // compute conv_result.hash for the input file
+    int hash_input;
+    // collect the conversions here instead of writing them, or NULL
+    write_list *defer;
+    // threads searching a large buffer in parallel, one if 1 or less
+    long scan_threads;
+    // convert through a small buffer instead of reading the whole file
+    int low_mem;
+    // append the conversions to this archive instead of writing files
+    pack_file *pack;
+    // leave out instruments no note uses and their samples
+    int strip;
+} conv_options;
+
+/* results of converting a file */
+typedef struct {
+    // hash of the whole input file, if conv_options.hash_input is set
+    u32 hash[2];
+    // counters for the statistics
+    long bytes_read;
+    // bytes searched by findsong() up to each module found
+    long bytes_scanned;
+    // findsong() hits that turned out to be no module
+    long rejected;
+    long modules;
+    // entries of all sections written, samples included
+    long entries;
+    long sample_bytes;
+    long bytes_written;
+    // times in microseconds
+    double read_time;
+    double scan_time;
+    double write_time;
+    // the output names were made by index_name(), the first one is _1
+    int numbered;
+} conv_result;
+
+/* search for the modules in a buffer, see next_module() */
+typedef struct {
+    char *dat;
+    long size;
+    // findsong() hits of a parallel search in offset order, each
+    // offset * 2 + 1 if parse_module() accepts it, or NULL
+    long *hits;
+    long hit_cnt;
+    long pos;
+} module_search;
+
+/* window a file is searched through with -l, also used for copying */
+#define STREAM_WINDOW 0x1000
+
+/* whole instruments that fit in the window */
+#define STREAM_INSTRS (STREAM_WINDOW / 0x98 * 0x98)
+
+/* input file converted through a small buffer, see stream_convert() */
+typedef struct {
+#ifdef HAVE_AMIGADOS
+    BPTR fh;
+#else
+    FILE *f;
+#endif
+    long size;
+    // file position, reading on from there needs no seek
+    long pos;
+    char *buf;
+    // bytes read, for the statistics
+    long bytes_read;
+    int failed;
+} stream_input;
+
+/* input file recorded in the manifest of an incremental batch */
+typedef struct {
+    char *in_name;
+    char *out_name;
+    long size;
+    long mtime;
+    u32 hash[2];
+    // the outputs were numbered, see conv_result.numbered
+    int numbered;
+    // still part of the collection, i.e. also in the current batch
+    int used;
+} manifest_entry;
+
+/* manifest of the last batch run, sorted by input name */
+typedef struct {
+    manifest_entry *entries;
+    long cnt;
+    long max;
+} manifest;
+
+/* one input file of a batch */
+typedef struct {
+    char *in_name;
+    // messages captured while converting in a worker thread
+    char *log;
+    size_t log_size;
+    int rc;
+    int done;
+    // unchanged since the last incremental run
+    int skipped;
+    // output name, size, time and hash for the manifest
+    char *out_name;
+    long size;
+    long mtime;
+    conv_result res;
+} batch_job;
+
+/* list of input files and shared state of a batch run */
+typedef struct {
+    batch_job *jobs;
+    long job_cnt;
+    long job_max;
+    char *out_dir;
+    // only scan the files and print a record for each
+    int scan;
+    conv_options opt;
+    // last run of an incremental batch, if manifest_name is set
+    char *manifest_name;
+    manifest last;
+    // print statistics at the end, write them as JSON to json_name
+    int stats;
+    char *json_name;
+    // run reading, scanning and writing as separate threads
+    int pipeline;
+    // read and write the files with io_uring, where available
+    int uring;
+    // archive for all conversions instead of out_dir, b.opt.pack
+    char *pack_name;
+#ifdef HAVE_PTHREAD
+    // next job not claimed by a worker, protected by lock
+    long next_job;
+    // next job to append its conversions to the archive, also
+    long pack_turn;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} batch;
+
+/* input file data, either mapped or read into the arena */
+typedef struct {
+    char *dat;
+    long size;
+    int mapped;
+    // read from a stream into memory of its own
+    int allocated;
+} conv_input;
+
+#ifdef HAVE_PTHREAD
+/* smallest buffer searched in parallel, and smallest part per thread */
+#define PAR_SCAN_MIN 0x400000L
+#define PAR_SCAN_CHUNK 0x100000L
+
+/* part of a buffer searched by one thread */
+typedef struct {
+    char *dat;
+    long size;
+    // hits from start to before end, the search reads 0x28 bytes more
+    long start;
+    long end;
+    long *hits;
+    long cnt;
+    long max;
+    int failed;
+    pthread_t thread;
+} scan_chunk;
+
+/* files a pipeline holds between its stages */
+#define PIPE_SLOTS 8
+
+/* counters handed between the pipeline stages without locks */
+#define PIPE_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PIPE_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* file on its way through a pipeline */
+typedef struct {
+    batch_job *job;
+    conv_input in;
+    // batch options, with the writes deferred to the write list
+    conv_options opt;
+    write_list writes;
+    // input data and deferred writes, kept until the writer is done
+    arena ar;
+    FILE *log;
+    int rc;
+    // read and not skipped, so it is to be converted
+    int convert;
+} pipe_slot;
 
 /*
- * convert - Do the actual conversion.
+ * Reader, scanner and writer thread with a ring of slots between them.
+ * Each stage only advances its own counter, a slot belongs to the
+ * reader again once the writer has passed it.
  */
-int convert(char *in_name, char *out_name) {
-    FILE *f_in, *f_out;
-    long f_in_size;
-    long read_len;
-    char *dat;
-    struct stat st;
+typedef struct {
+    batch *b;
+    pipe_slot slots[PIPE_SLOTS];
+    long read_cnt;
+    long scan_cnt;
+    long write_cnt;
+    int read_done;
+    int scan_done;
+    pthread_t threads[3];
+    int running[3];
+} pipeline;
+#endif
+
+#ifdef HAVE_SOCKETS
+/* largest input the server accepts in a request */
+#define SERVER_MAX_INPUT 0x4000000L
+/* seconds a client may stall within a request before it is dropped */
+#define SERVER_TIMEOUT 10
+
+/* connections of the server, and the requests waiting for a worker */
+typedef struct {
+    // listening socket, the pipe and the idle connections, see run_server()
+    struct pollfd *fds;
+    long fd_cnt;
+    long fd_max;
+    // workers write the connections they are done with to wake[1]
+    int wake[2];
+    // connections with a request, ready[first] to ready[cnt - 1]
+    int *ready;
+    long ready_first;
+    long ready_cnt;
+    long ready_max;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} server;
+
+/* worker of the server, with buffers kept from request to request */
+typedef struct {
+    server *s;
+    arena ar;
+    char *buf;
+    long buf_size;
+    pthread_t thread;
+} server_worker;
+#endif
+
+#ifdef HAVE_IO_URING
+/* operations queued on a ring before they are submitted */
+#define URING_ENTRIES 64
+
+/* files read, converted and written together by a worker */
+#define URING_FILES 64
+
+/* io_uring set up with the plain system calls, no liburing needed */
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned entries;
+    // operations prepared but not submitted yet
+    unsigned queued;
+} uring;
+
+/* input file of a round of a uring worker */
+typedef struct {
+    batch_job *job;
+    FILE *log;
+    conv_input in;
+    write_list writes;
+    struct statx stx;
+    // results of the operations, stored by uring_run()
+    int open_res;
+    int stat_res;
+    int read_res;
+    int fd;
+    // bytes read so far, and bytes of the conversions to write
+    long got;
+    long out_size;
     int rc;
-    long i;
-    long offset;
-    long i_offset;
-    long song_offset, over_offset, note_offset, instr_offset;
-    long wave_offset, adsr_offset, amf_offset, sample_offset;
-    long song_len, over_len, note_len, instr_len, wave_len;
-    long adsr_len, amf_len, sample_len;
-    long song_cnt, over_cnt, note_cnt, instr_cnt, wave_cnt;
-    long adsr_cnt, amf_cnt, sample_cnt;
-    short instr_sample_id;
-    long s_len;
-    long samples_info_size;
-    sample_info (*samples_info)[];
+    // read and not skipped, so it is to be converted
+    int convert;
+    int ready;
+} uring_file;
 
-    rc = stat(in_name, &st);
-    if(rc == -1) {
-        printf("stat error file: %s\n", in_name);
-    }
+/* output file of a round of a uring worker */
+typedef struct {
+    pending_write *w;
+    uring_file *f;
+    struct iovec iov[MAX_PIECES];
+    int iov_first;
+    long left;
+    long written;
+    int open_res;
+    int write_res;
+    int close_res;
+    int fd;
+    int failed;
+} uring_out;
 
-    f_in_size = st.st_size;
+/* worker thread with a ring of its own */
+typedef struct {
+    batch *b;
+    uring u;
+    // batch options, with the writes deferred to the current file
+    conv_options opt;
+    uring_file files[URING_FILES];
+    // files claimed at a time
+    long round;
+    pthread_t thread;
+} uring_worker;
+#endif
+
+/*
+ * now_us - Time in microseconds, for the statistics.
+ */
+double now_us(void) {
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+    return clock() * (1e6 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * log_msg - Print a message to log, unless log is NULL.
+ */
+void log_msg(FILE *log, char *fmt, ...) {
+    va_list args;
+
+    if(log == NULL)
+        return;
+
+    va_start(args, fmt);
+    vfprintf(log, fmt, args);
+    va_end(args);
+}
+
+/*
+ * read_input - Read the whole input file into the arena.
+ * On the Amiga this is a single dos.library Read() of the whole file.
+ */
+int read_input(char *in_name, long f_in_size, conv_input *in, arena *ar, FILE *log) {
+#ifdef HAVE_AMIGADOS
+    BPTR f_in;
+#else
+    FILE *f_in;
+#endif
+    long read_len;
 
+#ifdef HAVE_AMIGADOS
+    f_in = Open(in_name, MODE_OLDFILE);
+    if(f_in == 0) {
+#else
     f_in = fopen(in_name, "rb");
     if(f_in == NULL) {
-        printf("Cannot open input file: %s\n", in_name);
+#endif
+        log_msg(log, "Cannot open input file: %s\n", in_name);
         return -1;
     }
 
-    printf("Source size=0x%lx\n", f_in_size);
-    dat = malloc(f_in_size);
-    read_len = fread(dat, 1, f_in_size, f_in);
+    in->dat = arena_alloc(ar, f_in_size);
+    if(in->dat == NULL) {
+        log_msg(log, "Cannot allocate memory for file: %s\n", in_name);
+#ifdef HAVE_AMIGADOS
+        Close(f_in);
+#else
+        fclose(f_in);
+#endif
+        return -1;
+    }
+#ifdef HAVE_AMIGADOS
+    read_len = Read(f_in, in->dat, f_in_size);
+    Close(f_in);
+#else
+    read_len = fread(in->dat, 1, f_in_size, f_in);
     fclose(f_in);
+#endif
 
     if(f_in_size == read_len) {
-        printf("Read 0x%lx bytes\n", read_len);
+        log_msg(log, "Read 0x%lx bytes\n", read_len);
     }
     else {
-        printf("Read failed. Expected 0x%08x, got 0x%08x bytes.\n", f_in_size, read_len);
-    }
-
-    offset = findsong(dat, f_in_size);
-    if(offset >= 0 && offset < f_in_size - 28) {
-        printf("Found module at 0x%lx\n", offset);
-
-        song_offset = offset + *((long *)(dat + offset));
-        over_offset = offset + *((long *)(dat + offset + 4));
-        note_offset = offset + *((long *)(dat + offset + 8));
-        instr_offset = offset + *((long *)(dat + offset + 12));
-        wave_offset = offset + *((long *)(dat + offset + 16));
-        adsr_offset = offset + *((long *)(dat + offset + 20));
-        amf_offset = offset + *((long *)(dat + offset + 24));
-        sample_offset = offset + *((long *)(dat + offset + 28));
-
-        // TODO Check offsets for buffer overflow
-
-        song_len = over_offset - song_offset;
-        over_len = note_offset - over_offset;
-        note_len = instr_offset - note_offset;
-        instr_len = wave_offset - instr_offset;
-        wave_len = adsr_offset - wave_offset;
-        adsr_len = amf_offset - adsr_offset;
-        amf_len = sample_offset - amf_offset;
-
-        song_cnt = song_len / 12;
-        over_cnt = over_len / 16;
-        note_cnt = note_len / 4;
-        instr_cnt = instr_len / 152;
-        wave_cnt = wave_len / 128;
-        adsr_cnt = adsr_len / 128;
-        amf_cnt = amf_len / 128;
-        sample_cnt = *((long *)(dat + sample_offset));
-
-        samples_info_size = sample_cnt * sizeof(sample_info);
-        samples_info = malloc(samples_info_size);
-
-        if(samples_info != NULL) {
-            memset(samples_info, 0, samples_info_size);
-
-            sample_len = 0;
-            for(i = 0; i < sample_cnt; i++) {
-                s_len = *((long *)(dat + sample_offset + 4 + i * 4));
-                sample_len += s_len;
-                (*samples_info)[i].length = s_len;
-            }
+        log_msg(log, "Read failed. Expected 0x%08lx, got 0x%08lx bytes.\n", f_in_size, read_len);
+        return -1;
+    }
 
-            // Gather info for samples from instrument entries
-            i_offset = instr_offset;
-            for(i = 0; i < instr_cnt; i++) {
-                if(*((unsigned short*) (dat + i_offset)) == 0) {
-                    // is sampled instrument
-                    instr_sample_id = *((unsigned short*)(dat + i_offset + 2));
-
-                    if(instr_sample_id >= 0 && instr_sample_id < sample_cnt) {
-                        (*samples_info)[instr_sample_id].length_from_instr = (long) *((unsigned short*)(dat + i_offset + 4));
-                        (*samples_info)[instr_sample_id].repeat_from_instr = (long) *((unsigned short*)(dat + i_offset + 6));
-                        (*samples_info)[instr_sample_id].name_from_instr = dat + i_offset + 0x7a;
-                    }
-                    else {
-                        printf("Inconsistent sample id 0x%04x in instrument %ld! Data ignored.\n", instr_sample_id, i);
-                    }
-                }
-                i_offset += 0x98;
-            }
+    in->size = f_in_size;
+    in->mapped = 0;
+
+    return 0;
+}
+
+/*
+ * read_stream - Read everything from a stream that cannot be seeked,
+ * e.g. a pipe, into a buffer that grows as needed.
+ */
+int read_stream(FILE *f, conv_input *in, FILE *log) {
+    char *dat = NULL;
+    char *p;
+    long size = 0;
+    long max = 0;
+    size_t len;
 
-            printf("song: 0x%08lx len=0x%08lx cnt=%ld\n", song_offset, song_len, song_cnt);
-            printf("over: 0x%08lx len=0x%08lx cnt=%ld\n", over_offset, over_len, over_cnt);
-            printf("note: 0x%08lx len=0x%08lx cnt=%ld\n", note_offset, note_len, note_cnt);
-            printf("inst: 0x%08lx len=0x%08lx cnt=%ld\n", instr_offset, instr_len, instr_cnt);
-            printf("wave: 0x%08lx len=0x%08lx cnt=%ld\n", wave_offset, wave_len, wave_cnt);
-            printf("adsr: 0x%08lx len=0x%08lx cnt=%ld\n", adsr_offset, adsr_len, adsr_cnt);
-            printf("amf : 0x%08lx len=0x%08lx cnt=%ld\n", amf_offset, amf_len, amf_cnt);
-            printf("smpl: 0x%08lx len=0x%08lx cnt=%ld\n", sample_offset, sample_len, sample_cnt);
-        
-            f_out = fopen(out_name, "wb");
-            if(f_out != 0) {
-                fwrite(SOAR_ID, 1, 8, f_out);
-
-                fwrite(STBL_ID, 1, 4, f_out);
-                fwrite(&song_cnt, 1, 4, f_out);
-                fwrite(dat + song_offset, 1, song_len, f_out);
-
-                fwrite(OVTB_ID, 1, 4, f_out);
-                fwrite(&over_cnt, 1, 4, f_out);
-                fwrite(dat + over_offset, 1, over_len, f_out);
-
-                fwrite(NTBL_ID, 1, 4, f_out);
-                fwrite(&note_cnt, 1, 4, f_out);
-                fwrite(dat + note_offset, 1, note_len, f_out);
-
-                fwrite(INST_ID, 1, 4, f_out);
-                fwrite(&instr_cnt, 1, 4, f_out);
-                fwrite(dat + instr_offset, 1, instr_len, f_out);
-
-                fwrite(SD8B_ID, 1, 4, f_out);
-                fwrite(&sample_cnt, 1, 4, f_out);
-                // write lengths, repeats, names, lengths
-                for(i = 0; i < sample_cnt; i++) {
-                    fwrite(&(*samples_info)[i].length_from_instr, 1, 4, f_out);
-                }
-                for(i = 0; i < sample_cnt; i++) {
-                    fwrite(&(*samples_info)[i].repeat_from_instr, 1, 4, f_out);
-                }
-                for(i = 0; i < sample_cnt; i++) {
-                    fwrite((*samples_info)[i].name_from_instr, 1, 30, f_out);
-                }
-                for(i = 0; i < sample_cnt; i++) {
-                    fwrite(&(*samples_info)[i].length, 1, 4, f_out);
-                }
-                fwrite(dat + sample_offset + 4 + sample_cnt * 4, 1, sample_len, f_out);
-
-                fwrite(SYWT_ID, 1, 4, f_out);
-                fwrite(&wave_cnt, 1, 4, f_out);
-                fwrite(dat + wave_offset, 1, wave_len, f_out);
-
-                fwrite(SYAR_ID, 1, 4, f_out);
-                fwrite(&adsr_cnt, 1, 4, f_out);
-                fwrite(dat + adsr_offset, 1, adsr_len, f_out);
-
-                fwrite(SYAF_ID, 1, 4, f_out);
-                fwrite(&amf_cnt, 1, 4, f_out);
-                fwrite(dat + amf_offset, 1, amf_len, f_out);
-
-                fwrite(EDAT_ID, 1, 8, f_out);
-                fwrite(EDAT_DATA, 1, 0x10, f_out);
-                fclose(f_out);
-
-                printf("Conversion written to: %s\n", out_name);
+    do {
+        if(size == max) {
+            max = max ? max * 2 : 0x10000;
+            p = realloc(dat, max);
+            if(p == NULL) {
+                log_msg(log, "Cannot allocate memory for standard input!\n");
+                free(dat);
+                return -1;
             }
-            else
-                printf("Cannot open file: %s\n", out_name);
+            dat = p;
+        }
+        len = fread(dat + size, 1, max - size, f);
+        size += len;
+    } while(len > 0);
+
+    if(ferror(f)) {
+        log_msg(log, "Read failed on standard input.\n");
+        free(dat);
+        return -1;
+    }
+
+    log_msg(log, "Read 0x%lx bytes from standard input\n", size);
+
+    in->dat = dat;
+    in->size = size;
+    in->allocated = 1;
+
+    return 0;
+}
+
+#ifdef HAVE_MMAP
+/*
+ * map_input - Map the input file instead of reading it, so only the
+ * pages that are scanned and copied are ever loaded.
+ * Returns -1 if the file cannot be mapped, e.g. because it is empty.
+ */
+int map_input(char *in_name, long f_in_size, conv_input *in, FILE *log) {
+    int fd;
+    void *p;
+
+    if(f_in_size <= 0)
+        return -1;
+
+    fd = open(in_name, O_RDONLY);
+    if(fd == -1)
+        return -1;
+
+    p = mmap(NULL, f_in_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return -1;
+
+    log_msg(log, "Mapped 0x%lx bytes\n", f_in_size);
+
+    in->dat = p;
+    in->size = f_in_size;
+    in->mapped = 1;
+
+    return 0;
+}
+#endif
+
+/*
+ * open_input - Make the input file data available in memory.
+ * With map set, uses a memory mapping where possible, and reads into
+ * the arena otherwise. The name "-" reads standard input.
+ */
+int open_input(char *in_name, int map, conv_input *in, arena *ar, FILE *log) {
+    struct stat st;
+
+    memset(in, 0, sizeof(conv_input));
+
+    if(strcmp(in_name, "-") == 0)
+        return read_stream(stdin, in, log);
+
+    if(stat(in_name, &st) == -1) {
+        log_msg(log, "stat error file: %s\n", in_name);
+        return -1;
+    }
+
+    log_msg(log, "Source size=0x%lx\n", (long)st.st_size);
+
+#ifdef HAVE_MMAP
+    if(map && map_input(in_name, st.st_size, in, log) == 0)
+        return 0;
+#endif
 
-            free(samples_info);
+    return read_input(in_name, st.st_size, in, ar, log);
+}
+
+/*
+ * close_input - Release the input file data.
+ * Read data stays in the arena until it is reset.
+ */
+void close_input(conv_input *in) {
+    if(in->allocated)
+        free(in->dat);
+#ifdef HAVE_MMAP
+    if(in->mapped)
+        munmap(in->dat, in->size);
+#endif
+    memset(in, 0, sizeof(conv_input));
+}
+
+/*
+ * out_open - Create out_name, or take standard output if it is "-",
+ * to be written through a buffer of size bytes. On the Amiga this uses
+ * dos.library directly, without the stdio buffer in between.
+ * Returns 0, or -1 if the file cannot be created.
+ */
+int out_open(out_file *o, char *out_name, long size) {
+    memset(o, 0, sizeof(out_file));
+    o->to_stdout = strcmp(out_name, "-") == 0;
+    o->size = size;
+
+    if(o->to_stdout)
+        fflush(stdout);
+
+#ifdef HAVE_AMIGADOS
+    o->buf = AllocMem(size, MEMF_PUBLIC);
+    if(o->buf == NULL)
+        return -1;
+    o->fh = o->to_stdout ? Output() : Open(out_name, MODE_NEWFILE);
+    if(o->fh == 0) {
+        FreeMem(o->buf, size);
+        return -1;
+    }
+#else
+    o->buf = malloc(size);
+    if(o->buf == NULL)
+        return -1;
+    o->f = o->to_stdout ? stdout : fopen(out_name, "wb");
+    if(o->f == NULL) {
+        free(o->buf);
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * out_raw - Write len bytes at p to the file, bypassing the buffer.
+ */
+void out_raw(out_file *o, char *p, long len) {
+#ifdef HAVE_AMIGADOS
+    if(Write(o->fh, p, len) != len)
+#else
+    if(fwrite(p, 1, len, o->f) != (size_t)len)
+#endif
+        o->failed = 1;
+}
+
+/*
+ * out_flush - Write what is in the buffer.
+ */
+void out_flush(out_file *o) {
+    if(o->len > 0)
+        out_raw(o, o->buf, o->len);
+    o->len = 0;
+}
+
+/*
+ * out_write - Add len bytes at p to the file. Small pieces are gathered
+ * in the buffer, pieces as large as the buffer go out directly.
+ */
+void out_write(out_file *o, char *p, long len) {
+    if(o->len + len > o->size)
+        out_flush(o);
+
+    if(len >= o->size) {
+        out_raw(o, p, len);
+        return;
+    }
+
+    memcpy(o->buf + o->len, p, len);
+    o->len += len;
+}
+
+/*
+ * out_close - Write the rest of the buffer and close the file.
+ * Returns 0, or -2 if writing failed.
+ */
+int out_close(out_file *o) {
+    out_flush(o);
+
+#ifdef HAVE_AMIGADOS
+    if(!o->to_stdout)
+        Close(o->fh);
+    FreeMem(o->buf, o->size);
+#else
+    if(o->to_stdout ? fflush(o->f) != 0 : fclose(o->f) != 0)
+        o->failed = 1;
+    free(o->buf);
+#endif
+
+    return o->failed ? -2 : 0;
+}
+
+#ifdef HAVE_WRITEV
+/*
+ * write_iov - Write all of cnt buffers to fd, going on after short
+ * writes. The iovec entries are changed on the way.
+ * Returns 0, or -1 if writing failed.
+ */
+int write_iov(int fd, struct iovec *v, int cnt) {
+    ssize_t written;
+
+    while(cnt > 0) {
+        written = writev(fd, v, cnt);
+        if(written == -1 && errno == EINTR)
+            continue;
+        if(written == -1)
+            return -1;
+        // Skip whatever was written, in case of a short write
+        while(cnt > 0 && (size_t)written >= v->iov_len) {
+            written -= v->iov_len;
+            v++;
+            cnt--;
         }
-        else {
-            printf("Cannot allocate memory for samples info!\n");
+        if(cnt > 0) {
+            v->iov_base = (char *)v->iov_base + written;
+            v->iov_len -= written;
         }
     }
-    else {
-        printf("Song not found in file: %s\n", in_name);
+
+    return 0;
+}
+#endif
+
+/*
+ * write_pieces - Write all pieces in order to a new file, or to
+ * standard output if out_name is "-".
+ * With writev() this is a single system call for the whole file.
+ * Otherwise the small pieces are gathered with the sections next to
+ * them, so a module goes out in a few large writes.
+ * Returns 0 on success, -1 if the file cannot be opened and -2 if
+ * writing failed.
+ */
+int write_pieces(char *out_name, out_piece *pieces, int piece_cnt) {
+#ifdef HAVE_WRITEV
+    int to_stdout;
+    struct iovec iov[MAX_PIECES];
+    int fd;
+    int i;
+
+    to_stdout = strcmp(out_name, "-") == 0;
+    if(to_stdout) {
+        fflush(stdout);
+        fd = STDOUT_FILENO;
     }
+    else
+        fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1)
+        return -1;
 
-    free(dat);
+    for(i = 0; i < piece_cnt; i++) {
+        iov[i].iov_base = pieces[i].base;
+        iov[i].iov_len = pieces[i].len;
+    }
 
-    return 0;
+    if(write_iov(fd, iov, piece_cnt) != 0) {
+        if(!to_stdout)
+            close(fd);
+        return -2;
+    }
+
+    if(to_stdout)
+        return 0;
+
+    return close(fd) == 0 ? 0 : -2;
+#else
+    out_file o;
+    int i;
+
+    if(out_open(&o, out_name, OUT_BUFFER) != 0)
+        return -1;
+
+    for(i = 0; i < piece_cnt; i++)
+        out_write(&o, pieces[i].base, pieces[i].len);
+
+    return out_close(&o);
+#endif
 }
 
-int main(int argc,char *argv[]) {
-    printf("sonicconv -- SonicArranger packed format converter\n");
-    printf("by Thomas Meyer <mnemotron@gmail.com>\n\n");
+/*
+ * print_section - Print offset, length and entries of a section.
+ */
+void print_section(char *name, module_section *sec, FILE *log) {
+    log_msg(log, "%s 0x%08lx len=0x%08lx cnt=%ld\n", name, sec->offset, sec->len, sec->cnt);
+}
 
-    if(argc < 3) {
-        printf("Usage: sonicconv <inputfile> <outputfile>\n");
-        exit(10);
+/*
+ * print_layout - Print the layout of a module. With dat NULL the
+ * instruments with a bad sample id are not listed.
+ */
+void print_layout(char *dat, module_layout *ml, FILE *log) {
+    long i;
+    long instr_sample_id;
+    char *instr;
+
+    if(dat != NULL && ml->bad_sample_ids > 0) {
+        instr = dat + ml->instr.offset;
+        for(i = 0; i < ml->instr.cnt; i++, instr += 0x98) {
+            instr_sample_id = get_word(instr + 2);
+            if(get_word(instr) == 0 && instr_sample_id >= ml->sample.cnt)
+                log_msg(log, "Inconsistent sample id 0x%04lx in instrument %ld! Data ignored.\n", instr_sample_id, i);
+        }
+    }
+
+    print_section("song:", &ml->song, log);
+    print_section("over:", &ml->over, log);
+    print_section("note:", &ml->note, log);
+    print_section("inst:", &ml->instr, log);
+    print_section("wave:", &ml->wave, log);
+    print_section("adsr:", &ml->adsr, log);
+    print_section("amf :", &ml->amf, log);
+    print_section("smpl:", &ml->sample, log);
+}
+
+/*
+ * join_path - Store dir and file joined by a separator in path, which
+ * must hold both plus two bytes. Both '/' and ':' are accepted as path
+ * separators, so this works for AmigaDOS and Unix.
+ */
+void join_path(char *path, char *dir, char *file) {
+    size_t dir_len;
+
+    strcpy(path, dir);
+    dir_len = strlen(dir);
+    if(dir_len > 0 && dir[dir_len - 1] != '/' && dir[dir_len - 1] != ':')
+        strcat(path, "/");
+    strcat(path, file);
+}
+
+/*
+ * copy_string - Copy a string to newly allocated memory.
+ */
+char *copy_string(char *str) {
+    char *p;
+
+    p = malloc(strlen(str) + 1);
+    if(p != NULL)
+        strcpy(p, str);
+
+    return p;
+}
+
+/*
+ * copy_file - Copy the file src_name to dst_name.
+ * Returns 0 on success, -1 if src_name cannot be read or dst_name
+ * not be written.
+ */
+int copy_file(char *src_name, char *dst_name, arena *ar) {
+    conv_input in;
+    out_piece piece;
+    int rc;
+
+    if(open_input(src_name, 1, &in, ar, NULL) != 0)
+        return -1;
+
+    piece.base = in.dat;
+    piece.len = in.size;
+    rc = write_pieces(dst_name, &piece, 1);
+    close_input(&in);
+
+    return rc == 0 ? 0 : -1;
+}
+
+/*
+ * module_hash - Hash of the module data up to the end of its samples.
+ */
+void module_hash(char *dat, module_layout *ml, u32 h[2]) {
+    sonic_hash(dat + ml->offset, module_end(ml) - ml->offset, h);
+}
+
+/*
+ * cache_name - Name of the cache file for a module, built from its
+ * module_hash() and length. Short enough for the 30 characters of an
+ * AmigaDOS file name.
+ * The name is allocated from the arena.
+ */
+char *cache_name(char *cache_dir, char *dat, module_layout *ml, arena *ar) {
+    u32 h[2];
+    char key[32];
+    long len;
+    char *name;
+
+    len = module_end(ml) - ml->offset;
+    module_hash(dat, ml, h);
+    sprintf(key, "%08lx%08lx%08lx.soar", (unsigned long)h[0], (unsigned long)h[1], (unsigned long)(u32)len);
+
+    name = arena_alloc(ar, strlen(cache_dir) + 1 + strlen(key) + 1);
+    if(name != NULL)
+        join_path(name, cache_dir, key);
+
+    return name;
+}
+
+/*
+ * store_cache - Put the pieces of a written conversion into the cache.
+ * They are written to a temporary name first and then renamed, so
+ * other workers never see a partial cache file.
+ */
+void store_cache(char *cache_file, out_piece *pieces, int piece_cnt, arena *ar) {
+    char *tmp_name;
+#if defined(HAVE_PTHREAD)
+    static unsigned long tmp_cnt = 0;
+#endif
+
+    tmp_name = arena_alloc(ar, strlen(cache_file) + 40);
+    if(tmp_name == NULL)
+        return;
+
+#if defined(HAVE_PTHREAD)
+    // Unique among all processes sharing the cache and their threads
+    sprintf(tmp_name, "%s.%lx.%lx", cache_file, (unsigned long)getpid(),
+        __atomic_fetch_add(&tmp_cnt, 1, __ATOMIC_RELAXED));
+#else
+    // The arena address is unique for every worker, short enough for
+    // an AmigaDOS file name
+    sprintf(tmp_name, "%s.%lx", cache_file, (unsigned long)ar & 0xffffffUL);
+#endif
+    if(write_pieces(tmp_name, pieces, piece_cnt) != 0 || rename(tmp_name, cache_file) != 0)
+        remove(tmp_name);
+}
+
+/*
+ * write_conversion - Write the pieces of a conversion to out_name, and
+ * also into cache_file unless it is NULL. Only errors are logged, the
+ * caller reports the conversion as written.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int write_conversion(out_piece *pieces, int piece_cnt, char *out_name, char *cache_file, arena *ar, FILE *log) {
+    int rc;
+
+    rc = write_pieces(out_name, pieces, piece_cnt);
+    if(rc == 0) {
+        if(cache_file != NULL)
+            store_cache(cache_file, pieces, piece_cnt, ar);
+    }
+    else if(rc == -1)
+        log_msg(log, "Cannot open file: %s\n", out_name);
+    else {
+        log_msg(log, "Write error on file: %s\n", out_name);
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/*
+ * write_module - Write the SOAR conversion of one module, and also
+ * into cache_file unless it is NULL.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int write_module(char *dat, module_layout *ml, char *out_name, char *cache_file, arena *ar, FILE *log) {
+    out_piece pieces[MAX_PIECES];
+    int piece_cnt;
+    char *head;
+
+    head = arena_alloc(ar, soar_head_size(ml));
+    if(head == NULL) {
+        log_msg(log, "Cannot allocate memory for output header!\n");
+        return -1;
     }
 
-    convert(argv[1], argv[2]);
+    piece_cnt = soar_pieces(dat, ml, head, pieces);
+    if(write_conversion(pieces, piece_cnt, out_name, cache_file, ar, log) != 0)
+        return -1;
+
+    log_msg(log, "Conversion written to: %s\n", out_name);
+
+    return 0;
+}
+
+/*
+ * copy_cached - Copy the conversion of the same module from the cache.
+ * Returns 0 if it was copied, -1 if it is not in the cache.
+ */
+int copy_cached(char *cache_file, char *out_name, arena *ar, FILE *log) {
+    if(copy_file(cache_file, out_name, ar) != 0)
+        return -1;
+
+    log_msg(log, "Conversion copied from cache: %s\n", cache_file);
+    log_msg(log, "Conversion written to: %s\n", out_name);
+
+    return 0;
+}
+
+/*
+ * defer_module - Add the conversion of one module to the write list
+ * opt->defer instead of writing it. The pieces point into dat and the
+ * arena, so both must be kept until flush_writes(). The conversion is
+ * logged as written here, so the log of a file reads the same as
+ * without deferring, only errors of the write itself come later.
+ * Returns 0, or -1 if out of memory.
+ */
+int defer_module(char *dat, module_layout *ml, char *out_name, char *cache_file, conv_options *opt, arena *ar, FILE *log) {
+    write_list *wl = opt->defer;
+    pending_write *w;
+    char *head;
+
+    w = arena_alloc(ar, sizeof(pending_write));
+    head = arena_alloc(ar, soar_head_size(ml));
+    if(w == NULL || head == NULL) {
+        log_msg(log, "Cannot allocate memory for output header!\n");
+        return -1;
+    }
+
+    w->next = NULL;
+    w->out_name = out_name;
+    w->cache_file = cache_file;
+    w->pack = opt->pack;
+    if(w->pack != NULL)
+        module_hash(dat, ml, w->hash);
+    w->piece_cnt = soar_pieces(dat, ml, head, w->pieces);
+
+    *wl->tail = w;
+    wl->tail = &w->next;
+
+    if(w->pack != NULL)
+        log_msg(log, "Conversion added to archive as: %s\n", out_name);
+    else
+        log_msg(log, "Conversion written to: %s\n", out_name);
+
+    return 0;
+}
+
+/*
+ * pack_open - Create the archive of a batch, see pack_close() for the
+ * layout.
+ * Returns 0, or -1 if it cannot be created.
+ */
+int pack_open(pack_file *pk, char *pack_name) {
+    memset(pk, 0, sizeof(pack_file));
+    pk->name = pack_name;
+
+    if(out_open(&pk->out, pack_name, OUT_BUFFER) != 0)
+        return -1;
+
+    out_write(&pk->out, PACK_ID, 8);
+    pk->pos = 8;
+
+    return 0;
+}
+
+/*
+ * pack_conversion - Append the pieces of a conversion to the archive
+ * and record it in the index under name, with the hash of the module.
+ * Returns 0, or -1 if it cannot be added.
+ */
+int pack_conversion(pack_file *pk, out_piece *pieces, int piece_cnt, char *name, u32 *hash, FILE *log) {
+    static char pad[4];
+    pack_entry *entries;
+    pack_entry *e;
+    long len = 0;
+    long max;
+    int i;
+
+    for(i = 0; i < piece_cnt; i++)
+        len += pieces[i].len;
+
+    // Offsets in the index are 32 bits
+    if(len > 0x7ffffff0L - pk->pos) {
+        log_msg(log, "Archive too large for: %s\n", name);
+        return -1;
+    }
+
+    if(pk->cnt == pk->max) {
+        max = pk->max > 0 ? pk->max * 2 : 256;
+        entries = realloc(pk->entries, max * sizeof(pack_entry));
+        if(entries == NULL) {
+            log_msg(log, "Cannot allocate memory for archive index!\n");
+            return -1;
+        }
+        pk->entries = entries;
+        pk->max = max;
+    }
+
+    e = &pk->entries[pk->cnt];
+    e->name = copy_string(name);
+    if(e->name == NULL) {
+        log_msg(log, "Cannot allocate memory for archive index!\n");
+        return -1;
+    }
+    e->offset = pk->pos;
+    e->len = len;
+    e->hash[0] = hash[0];
+    e->hash[1] = hash[1];
+    pk->cnt++;
+
+    for(i = 0; i < piece_cnt; i++)
+        out_write(&pk->out, pieces[i].base, pieces[i].len);
+    // Keep the longs of the next conversion aligned
+    out_write(&pk->out, pad, -len & 3);
+    pk->pos += (len + 3) & ~3L;
+
+    if(pk->out.failed) {
+        log_msg(log, "Write error on file: %s\n", pk->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * pack_module - Append the SOAR conversion of one module to the archive.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int pack_module(char *dat, module_layout *ml, char *out_name, pack_file *pk, arena *ar, FILE *log) {
+    out_piece pieces[MAX_PIECES];
+    int piece_cnt;
+    char *head;
+    u32 h[2];
+
+    head = arena_alloc(ar, soar_head_size(ml));
+    if(head == NULL) {
+        log_msg(log, "Cannot allocate memory for output header!\n");
+        return -1;
+    }
+
+    piece_cnt = soar_pieces(dat, ml, head, pieces);
+    module_hash(dat, ml, h);
+    if(pack_conversion(pk, pieces, piece_cnt, out_name, h, log) != 0)
+        return -1;
+
+    log_msg(log, "Conversion added to archive as: %s\n", out_name);
+
+    return 0;
+}
+
+/*
+ * pack_name_cmp - Order archive entries by name, then by offset.
+ */
+int pack_name_cmp(const void *a, const void *b) {
+    pack_entry *ea = (pack_entry *)a;
+    pack_entry *eb = (pack_entry *)b;
+    int rc;
+
+    rc = strcmp(ea->name, eb->name);
+    if(rc != 0)
+        return rc;
+
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/*
+ * pack_hash_cmp - Order pointers to archive entries by hash, then by
+ * offset.
+ */
+int pack_hash_cmp(const void *a, const void *b) {
+    pack_entry *ea = *(pack_entry **)a;
+    pack_entry *eb = *(pack_entry **)b;
+
+    if(ea->hash[0] != eb->hash[0])
+        return ea->hash[0] < eb->hash[0] ? -1 : 1;
+    if(ea->hash[1] != eb->hash[1])
+        return ea->hash[1] < eb->hash[1] ? -1 : 1;
+
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/*
+ * pack_close - Write the index and close the archive, which consists of
+ *   "SPAKV1.0"
+ *   the conversions, each padded to a multiple of 4 bytes
+ *   "INDX" and the number of entries
+ *   the entries sorted by name, 5 longs each: offset and length of the
+ *   conversion, the two longs of the module hash and the offset of the
+ *   name from the start of the names
+ *   the entry numbers sorted by hash, one long each
+ *   the names, each ended by a zero byte, padded to a multiple of 4
+ *   the offset of "INDX" as last long of the file
+ * All longs are big-endian.
+ * Returns 0, or -1 if the index cannot be written.
+ */
+int pack_close(pack_file *pk) {
+    static char pad[4];
+    pack_entry **by_hash;
+    pack_entry *e;
+    char buf[20];
+    long index_pos;
+    long name_pos = 0;
+    long i;
+    int rc = 0;
+
+    by_hash = malloc((pk->cnt + 1) * sizeof(pack_entry *));
+    if(by_hash == NULL)
+        rc = -1;
+
+    if(by_hash != NULL) {
+        qsort(pk->entries, pk->cnt, sizeof(pack_entry), pack_name_cmp);
+        for(i = 0; i < pk->cnt; i++)
+            by_hash[i] = &pk->entries[i];
+        qsort(by_hash, pk->cnt, sizeof(pack_entry *), pack_hash_cmp);
+
+        index_pos = pk->pos;
+        put_chunk(buf, "INDX", pk->cnt);
+        out_write(&pk->out, buf, 8);
+
+        for(i = 0; i < pk->cnt; i++) {
+            e = &pk->entries[i];
+            put_long(buf, e->offset);
+            put_long(buf + 4, e->len);
+            put_long(buf + 8, e->hash[0]);
+            put_long(buf + 12, e->hash[1]);
+            put_long(buf + 16, name_pos);
+            out_write(&pk->out, buf, 20);
+            name_pos += strlen(e->name) + 1;
+        }
+
+        for(i = 0; i < pk->cnt; i++) {
+            put_long(buf, by_hash[i] - pk->entries);
+            out_write(&pk->out, buf, 4);
+        }
+
+        for(i = 0; i < pk->cnt; i++)
+            out_write(&pk->out, pk->entries[i].name, strlen(pk->entries[i].name) + 1);
+        out_write(&pk->out, pad, -name_pos & 3);
+
+        put_long(buf, index_pos);
+        out_write(&pk->out, buf, 4);
+    }
+
+    if(out_close(&pk->out) != 0)
+        rc = -1;
+
+    for(i = 0; i < pk->cnt; i++)
+        free(pk->entries[i].name);
+    free(pk->entries);
+    free(by_hash);
+
+    return rc;
+}
+
+/*
+ * flush_writes - Write all conversions of a write list and empty it.
+ * Returns 0 if all were written, -1 otherwise.
+ */
+int flush_writes(write_list *wl, arena *ar, FILE *log) {
+    pending_write *w;
+    int rc = 0;
+
+    for(w = wl->head; w != NULL; w = w->next) {
+        if(w->pack != NULL) {
+            if(pack_conversion(w->pack, w->pieces, w->piece_cnt, w->out_name, w->hash, log) != 0)
+                rc = -1;
+            continue;
+        }
+        if(write_conversion(w->pieces, w->piece_cnt, w->out_name, w->cache_file, ar, log) != 0)
+            rc = -1;
+    }
+
+    wl->head = NULL;
+    wl->tail = &wl->head;
+
+    return rc;
+}
+
+/*
+ * output_module - Write one module to out_name, taking the conversion
+ * from the cache when the same module was converted before. With
+ * opt->defer it is only added to that write list, with opt->pack it
+ * goes into the archive under out_name.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int output_module(char *dat, module_layout *ml, char *out_name, conv_options *opt, arena *ar, FILE *log) {
+    char *cache_file = NULL;
+
+    if(opt->cache_dir != NULL)
+        cache_file = cache_name(opt->cache_dir, dat, ml, ar);
+
+    if(cache_file != NULL && copy_cached(cache_file, out_name, ar, log) == 0)
+        return 0;
+
+    if(opt->defer != NULL)
+        return defer_module(dat, ml, out_name, cache_file, opt, ar, log);
+
+    if(opt->pack != NULL)
+        return pack_module(dat, ml, out_name, opt->pack, ar, log);
+
+    return write_module(dat, ml, out_name, cache_file, ar, log);
+}
+
+/*
+ * index_name - Output name for the index-th module of a file: the
+ * index is put in front of the extension, "song.sa" becomes "song_2.sa".
+ * The name is allocated from the arena.
+ */
+char *index_name(char *out_name, long index, arena *ar) {
+    char *base;
+    char *ext = NULL;
+    char *name;
+    char *p;
+
+    base = out_name;
+    for(p = out_name; *p; p++) {
+        if(*p == '/' || *p == ':')
+            base = p + 1;
+    }
+    for(p = base + 1; *base && *p; p++) {
+        if(*p == '.')
+            ext = p;
+    }
+    if(ext == NULL)
+        ext = out_name + strlen(out_name);
+
+    name = arena_alloc(ar, strlen(out_name) + 12);
+    if(name != NULL)
+        sprintf(name, "%.*s_%ld%s", (int)(ext - out_name), out_name, index, ext);
+
+    return name;
+}
+
+/*
+ * count_module - Add a module written to the counters.
+ */
+void count_module(module_layout *ml, conv_result *res) {
+    res->modules++;
+    res->entries += ml->song.cnt + ml->over.cnt + ml->note.cnt + ml->instr.cnt
+        + ml->wave.cnt + ml->adsr.cnt + ml->amf.cnt + ml->sample.cnt;
+    res->sample_bytes += ml->sample.len;
+    res->bytes_written += soar_output_size(ml);
+}
+
+/*
+ * strip_unused - Replace a module by a copy without the instruments no
+ * note uses and their samples, see strip_module(), if there are any.
+ * The copy is allocated from the arena, *dat and *ml are set to it
+ * and its layout, which is stored in copy.
+ * Returns 0, or -1 if out of memory.
+ */
+int strip_unused(char **dat, module_layout **ml, module_layout *copy, arena *ar, FILE *log) {
+    char *p;
+    long len;
+
+    len = strip_module(*dat, *ml, &p, ar);
+    if(len == 0)
+        return 0;
+    if(len < 0 || parse_module(p, len, 0, copy, ar) != 0) {
+        log_msg(log, "Cannot allocate memory for stripped module!\n");
+        return -1;
+    }
+
+    log_msg(log, "Left out %ld of %ld instrument(s) and %ld of %ld sample(s), 0x%lx bytes\n",
+        (*ml)->instr.cnt - copy->instr.cnt, (*ml)->instr.cnt,
+        (*ml)->sample.cnt - copy->sample.cnt, (*ml)->sample.cnt,
+        soar_output_size(*ml) - soar_output_size(copy));
+
+    *dat = p;
+    *ml = copy;
+
+    return 0;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * scan_chunk_thread - Collect the findsong() hits of one part of a
+ * buffer, checked by parse_module() like find_module_from() does.
+ */
+void *scan_chunk_thread(void *arg) {
+    scan_chunk *c = arg;
+    module_layout ml;
+    long *hits;
+    long offset;
+    long pos;
+    long len;
+
+    // A match at end - 2 needs the 0x28 bytes after it
+    len = c->end + 0x28 < c->size ? c->end + 0x28 : c->size;
+
+    for(pos = c->start; pos < c->end; pos = offset + 2) {
+        offset = findsong(c->dat + pos, len - pos);
+        if(offset < 0 || pos + offset >= c->end)
+            break;
+        offset += pos;
+
+        if(c->cnt == c->max) {
+            c->max = c->max ? c->max * 2 : 64;
+            hits = realloc(c->hits, c->max * sizeof(long));
+            if(hits == NULL) {
+                c->failed = 1;
+                break;
+            }
+            c->hits = hits;
+        }
+        c->hits[c->cnt++] = offset * 2 + (parse_module(c->dat, c->size, offset, &ml, NULL) == 0);
+    }
+
+    return NULL;
+}
+
+/*
+ * parallel_search - Split the buffer of ms into one part per thread and
+ * search them all at once, the calling thread takes the first part.
+ * The hits are joined in offset order into the arena.
+ * Returns -1 if out of memory, ms->hits is left NULL then.
+ */
+int parallel_search(module_search *ms, long threads, arena *ar) {
+    scan_chunk *chunks;
+    long part;
+    long pos;
+    long i;
+    int rc = 0;
+
+    chunks = calloc(threads, sizeof(scan_chunk));
+    if(chunks == NULL)
+        return -1;
+
+    // Parts start at even offsets, where findsong() looks for matches
+    part = (ms->size / threads + 1) & ~1L;
+    for(i = 0; i < threads; i++) {
+        chunks[i].dat = ms->dat;
+        chunks[i].size = ms->size;
+        chunks[i].start = i * part;
+        chunks[i].end = i + 1 < threads ? (i + 1) * part : ms->size;
+    }
+
+    for(i = 1; i < threads; i++) {
+        // Without a thread the part is searched here below
+        if(pthread_create(&chunks[i].thread, NULL, scan_chunk_thread, &chunks[i]) != 0)
+            chunks[i].failed = -1;
+    }
+    scan_chunk_thread(&chunks[0]);
+
+    ms->hit_cnt = 0;
+    for(i = 0; i < threads; i++) {
+        if(chunks[i].failed == -1) {
+            chunks[i].failed = 0;
+            scan_chunk_thread(&chunks[i]);
+        }
+        else if(i > 0)
+            pthread_join(chunks[i].thread, NULL);
+        if(chunks[i].failed)
+            rc = -1;
+        ms->hit_cnt += chunks[i].cnt;
+    }
+
+    if(rc == 0)
+        ms->hits = arena_alloc(ar, ms->hit_cnt * sizeof(long));
+    if(ms->hits == NULL)
+        rc = -1;
+
+    for(i = 0, pos = 0; i < threads; i++) {
+        if(rc == 0)
+            memcpy(ms->hits + pos, chunks[i].hits, chunks[i].cnt * sizeof(long));
+        pos += chunks[i].cnt;
+        free(chunks[i].hits);
+    }
+    free(chunks);
+
+    return rc;
+}
+#endif
+
+/*
+ * start_search - Set up the search for the modules in a buffer. With
+ * threads and a large buffer, the whole buffer is searched in parallel
+ * right away, otherwise next_module() searches as it goes.
+ */
+void start_search(module_search *ms, char *dat, long size, long threads, arena *ar) {
+    memset(ms, 0, sizeof(module_search));
+    ms->dat = dat;
+    ms->size = size;
+
+#ifdef HAVE_PTHREAD
+    if(threads > size / PAR_SCAN_CHUNK)
+        threads = size / PAR_SCAN_CHUNK;
+    // Too little memory for the hits just means searching in one thread
+    if(ar != NULL && threads > 1 && size >= PAR_SCAN_MIN && parallel_search(ms, threads, ar) != 0)
+        ms->hits = NULL;
+#endif
+}
+
+/*
+ * next_module - Find the next module at or after start and build its
+ * layout, same as find_module_from() but taking the hits of a parallel
+ * search if there are any. start must not go back.
+ * Returns the module offset or a negative SONIC_ERR_* code.
+ */
+long next_module(module_search *ms, long start, module_layout *ml, arena *ar) {
+    long rejected = 0;
+    long offset;
+    long hit;
+    int rc;
+
+    if(ms->hits == NULL)
+        return find_module_from(ms->dat, ms->size, start, ml, ar);
+
+    for(; ms->pos < ms->hit_cnt; ms->pos++) {
+        hit = ms->hits[ms->pos];
+        offset = hit >> 1;
+        if(offset < start)
+            continue;
+        if(!(hit & 1)) {
+            rejected++;
+            continue;
+        }
+
+        rc = parse_module(ms->dat, ms->size, offset, ml, ar);
+        ml->rejected = rejected;
+        return rc < 0 ? rc : offset;
+    }
+
+    ml->rejected = rejected;
+
+    return SONIC_ERR_NOT_FOUND;
+}
+
+/*
+ * convert_modules - Write the modules found in a buffer, only the first
+ * one unless opt->all. With numbered set, the output names are made by
+ * index_name(), counting on from *index. member is the container member
+ * the buffer was unpacked from, or NULL. Counters go to res, if not NULL.
+ * Returns 0, or -1 if a module could not be written.
+ */
+int convert_modules(char *dat, long size, char *member, char *out_name, int numbered, long *index,
+        conv_options *opt, conv_result *res, arena *ar, FILE *log) {
+    module_search ms;
+    module_layout ml;
+    module_layout stripped;
+    module_layout *out_ml;
+    char *out_dat;
+    char *name;
+    double t0, t1;
+    long offset;
+    long start = 0;
+    int rc = 0;
+
+    t0 = now_us();
+    start_search(&ms, dat, size, opt->scan_threads, ar);
+    offset = next_module(&ms, 0, &ml, ar);
+    t1 = now_us();
+
+    for(;;) {
+        if(res != NULL) {
+            res->scan_time += t1 - t0;
+            res->bytes_scanned += (offset >= 0 ? offset : size) - start;
+            res->rejected += ml.rejected;
+        }
+        if(offset < 0)
+            break;
+
+        if(member != NULL)
+            log_msg(log, "Found module at 0x%lx in member: %s\n", offset, member);
+        else
+            log_msg(log, "Found module at 0x%lx\n", offset);
+        print_layout(dat, &ml, log);
+
+        ++*index;
+        name = numbered ? index_name(out_name, *index, ar) : out_name;
+        // The search goes on behind the module in dat, not the copy
+        out_dat = dat;
+        out_ml = &ml;
+        if(opt->strip && strip_unused(&out_dat, &out_ml, &stripped, ar, log) != 0)
+            rc = -1;
+        else if(name == NULL || output_module(out_dat, out_ml, name, opt, ar, log) != 0)
+            rc = -1;
+        else if(res != NULL)
+            count_module(out_ml, res);
+
+        if(res != NULL)
+            res->write_time += now_us() - t1;
+
+        if(!opt->all)
+            break;
+
+        start = module_end(&ml);
+        t0 = now_us();
+        offset = next_module(&ms, start, &ml, ar);
+        t1 = now_us();
+    }
+
+    if(offset == SONIC_ERR_MEMORY) {
+        log_msg(log, "Cannot allocate memory for samples info!\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/* state of converting the members of a container */
+typedef struct {
+    char *out_name;
+    conv_options *opt;
+    conv_result *res;
+    long index;
+    int rc;
+    arena *ar;
+    FILE *log;
+} member_conv;
+
+/*
+ * convert_member - Convert the modules in one member of a container.
+ */
+int convert_member(char *name, char *dat, long size, void *ctx) {
+    member_conv *mc = ctx;
+    char *copy;
+    int to_stdout;
+
+    if(dat == NULL) {
+        log_msg(mc->log, "Cannot unpack member: %s\n", name);
+        return 0;
+    }
+
+    // Deferred writes need the data after the member buffer is reused
+    if(mc->opt->defer != NULL && findsong(dat, size) >= 0) {
+        copy = arena_alloc(mc->ar, size);
+        if(copy == NULL) {
+            log_msg(mc->log, "Cannot allocate memory for member: %s\n", name);
+            mc->rc = -1;
+            return 0;
+        }
+        dat = memcpy(copy, dat, size);
+    }
+
+    // Standard output takes only the first module, under its own name
+    to_stdout = strcmp(mc->out_name, "-") == 0;
+    if(convert_modules(dat, size, name, mc->out_name, !to_stdout, &mc->index, mc->opt, mc->res, mc->ar, mc->log) != 0)
+        mc->rc = -1;
+
+    return to_stdout && mc->index > 0;
+}
+
+/*
+ * convert_input - Convert the modules of an input file in memory.
+ * With opt->all every module in the file is converted, each into its
+ * own file named by index_name(). Members of ADF images and LhA
+ * archives are converted without extracting them, into numbered files,
+ * or only the first module if out_name is "-" for standard output. If no
+ * member contains a module, the file itself is searched.
+ * Results go to res, if not NULL. Messages go to log.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int convert_input(char *in_name, conv_input *in, char *out_name, conv_options *opt, conv_result *res, arena *ar, FILE *log) {
+    member_conv mc;
+    long index = 0;
+    long cnt;
+    int type;
+    int rc = 0;
+
+    if(res != NULL && opt->hash_input)
+        sonic_hash(in->dat, in->size, res->hash);
+
+    type = container_type(in->dat, in->size);
+    if(type != CONTAINER_NONE) {
+        mc.out_name = out_name;
+        mc.opt = opt;
+        mc.res = res;
+        mc.index = 0;
+        mc.rc = 0;
+        mc.ar = ar;
+        mc.log = log;
+
+        cnt = container_members(in->dat, in->size, convert_member, &mc, ar);
+        if(cnt == SONIC_ERR_MEMORY) {
+            log_msg(log, "Cannot allocate memory for %s container: %s\n", container_name(type), in_name);
+            rc = -1;
+        } else if(cnt < 0) {
+            log_msg(log, "Cannot read %s container: %s\n", container_name(type), in_name);
+        } else {
+            log_msg(log, "%ld member(s) in %s container: %s\n", cnt, container_name(type), in_name);
+        }
+
+        index = mc.index;
+        if(mc.rc != 0)
+            rc = -1;
+    }
+
+    if(res != NULL)
+        res->numbered = index > 0 ? strcmp(out_name, "-") != 0 : opt->all;
+
+    if(index == 0 && convert_modules(in->dat, in->size, NULL, out_name, opt->all, &index, opt, res, ar, log) != 0)
+        rc = -1;
+
+    if(index == 0) {
+        log_msg(log, "Song not found in file: %s\n", in_name);
+        rc = -1;
+    } else if(opt->all || type != CONTAINER_NONE) {
+        log_msg(log, "%ld module(s) found in file: %s\n", index, in_name);
+    }
+
+    return rc;
+}
+
+/*
+ * read_job_input - Read an input file for conversion, counting the
+ * time and bytes in res, if not NULL.
+ */
+int read_job_input(char *in_name, int map, conv_input *in, conv_result *res, arena *ar, FILE *log) {
+    double t0;
+
+    t0 = now_us();
+    if(open_input(in_name, map, in, ar, log) != 0)
+        return -1;
+
+    if(res != NULL) {
+        res->read_time += now_us() - t0;
+        res->bytes_read += in->size;
+    }
+
+    return 0;
+}
+
+/*
+ * stream_open - Open a file for stream_convert() and look up its size.
+ * Returns 0, or -1 if it cannot be opened.
+ */
+int stream_open(stream_input *si, char *in_name) {
+    memset(si, 0, sizeof(stream_input));
+
+#ifdef HAVE_AMIGADOS
+    si->fh = Open(in_name, MODE_OLDFILE);
+    if(si->fh == 0)
+        return -1;
+    // Seek() returns the position before, the end on the way back
+    Seek(si->fh, 0, OFFSET_END);
+    si->size = Seek(si->fh, 0, OFFSET_BEGINNING);
+#else
+    si->f = fopen(in_name, "rb");
+    if(si->f == NULL)
+        return -1;
+    si->size = fseek(si->f, 0, SEEK_END) == 0 ? ftell(si->f) : -1;
+    rewind(si->f);
+#endif
+
+    return 0;
+}
+
+/*
+ * stream_close - Close a file opened by stream_open().
+ */
+void stream_close(stream_input *si) {
+#ifdef HAVE_AMIGADOS
+    Close(si->fh);
+#else
+    fclose(si->f);
+#endif
+}
+
+/*
+ * stream_read - Read len bytes at offset of a streamed input into buf.
+ * Only seeks if offset is not where the last read ended, as seeking is
+ * slow on floppies, since OFS has to follow the block list.
+ * Returns 0, or -1 if they cannot be read.
+ */
+int stream_read(stream_input *si, long offset, char *buf, long len) {
+#ifdef HAVE_AMIGADOS
+    if((offset != si->pos && Seek(si->fh, offset, OFFSET_BEGINNING) == -1) || Read(si->fh, buf, len) != len) {
+#else
+    if((offset != si->pos && fseek(si->f, offset, SEEK_SET) != 0) || fread(buf, 1, len, si->f) != (size_t)len) {
+#endif
+        // Seek again next time
+        si->pos = -1;
+        si->failed = 1;
+        return -1;
+    }
+
+    si->pos = offset + len;
+    si->bytes_read += len;
+
+    return 0;
+}
+
+/*
+ * stream_check - Check a findsong() hit in a streamed input like
+ * check_module() does, reading the sample table and the instruments
+ * a window at a time, and fill in the sections of the layout.
+ * Returns 0 or SONIC_ERR_NOT_FOUND.
+ */
+int stream_check(stream_input *si, long offset, module_layout *ml) {
+    static long entry_size[7] = { 12, 16, 4, 0x98, 128, 128, 128 };
+    long sections[8];
+    long sample_cnt;
+    long free_len;
+    long s_len;
+    long pos;
+    long len;
+    long i;
+    char *p;
+
+    memset(ml, 0, sizeof(module_layout));
+
+    if(offset < 0 || offset > si->size - 32 || stream_read(si, offset, si->buf, 32) != 0)
+        return SONIC_ERR_NOT_FOUND;
+
+    for(i = 0; i < 8; i++) {
+        s_len = get_long(si->buf + i * 4);
+        sections[i] = s_len >= 0 && s_len <= si->size ? offset + s_len : -1;
+    }
+
+    if(sections[0] < 0)
+        return SONIC_ERR_NOT_FOUND;
+    for(i = 0; i < 7; i++) {
+        if(sections[i + 1] < sections[i] || (sections[i + 1] - sections[i]) % entry_size[i] != 0)
+            return SONIC_ERR_NOT_FOUND;
+    }
+    if(sections[7] > si->size - 4 || stream_read(si, sections[7], si->buf, 4) != 0)
+        return SONIC_ERR_NOT_FOUND;
+
+    sample_cnt = get_long(si->buf);
+    free_len = si->size - sections[7] - 4;
+    if(sample_cnt < 0 || sample_cnt > free_len / 4)
+        return SONIC_ERR_NOT_FOUND;
+
+    free_len -= sample_cnt * 4;
+    for(pos = 0; pos < sample_cnt * 4; pos += len) {
+        len = sample_cnt * 4 - pos < STREAM_WINDOW ? sample_cnt * 4 - pos : STREAM_WINDOW;
+        if(stream_read(si, sections[7] + 4 + pos, si->buf, len) != 0)
+            return SONIC_ERR_NOT_FOUND;
+        for(p = si->buf; p < si->buf + len; p += 4) {
+            s_len = get_long(p);
+            if(s_len < 0 || s_len > free_len)
+                return SONIC_ERR_NOT_FOUND;
+            free_len -= s_len;
+            ml->sample.len += s_len;
+        }
+    }
+
+    for(pos = sections[3]; pos < sections[4]; pos += len) {
+        len = sections[4] - pos < STREAM_INSTRS ? sections[4] - pos : STREAM_INSTRS;
+        if(stream_read(si, pos, si->buf, len) != 0)
+            return SONIC_ERR_NOT_FOUND;
+        for(p = si->buf; p < si->buf + len; p += 0x98) {
+            if(get_word(p) == 0 && get_word(p + 2) > MAX_SAMPLE_ID)
+                return SONIC_ERR_NOT_FOUND;
+        }
+    }
+
+    ml->offset = offset;
+    parse_section(&ml->song, sections[0], sections[1], 12);
+    parse_section(&ml->over, sections[1], sections[2], 16);
+    parse_section(&ml->note, sections[2], sections[3], 4);
+    parse_section(&ml->instr, sections[3], sections[4], 152);
+    parse_section(&ml->wave, sections[4], sections[5], 128);
+    parse_section(&ml->adsr, sections[5], sections[6], 128);
+    parse_section(&ml->amf, sections[6], sections[7], 128);
+    ml->sample.offset = sections[7];
+    ml->sample.cnt = sample_cnt;
+    ml->sample_data_offset = sections[7] + 4 + sample_cnt * 4;
+
+    return 0;
+}
+
+/*
+ * stream_find - Find the next module at or after start in a streamed
+ * input, searching it through a window that overlaps the one before
+ * by the 0x28 bytes a match needs. Hits that fail stream_check() are
+ * counted in ml->rejected.
+ * Returns the module offset or SONIC_ERR_NOT_FOUND.
+ */
+long stream_find(stream_input *si, long start, module_layout *ml) {
+    long rejected = 0;
+    long offset;
+    long pos;
+    long len;
+
+    // Modules are word aligned
+    pos = (start + 1) & ~1L;
+
+    while(pos < si->size - 0x28) {
+        len = si->size - pos < STREAM_WINDOW ? si->size - pos : STREAM_WINDOW;
+        if(stream_read(si, pos, si->buf, len) != 0)
+            break;
+
+        offset = findsong(si->buf, len);
+        if(offset >= 0) {
+            // stream_check() reuses the window, so go on behind the hit
+            offset += pos;
+            if(stream_check(si, offset, ml) == 0) {
+                ml->rejected = rejected;
+                return offset;
+            }
+            rejected++;
+            pos = offset + 2;
+        }
+        else if(len == STREAM_WINDOW)
+            pos += STREAM_WINDOW - 0x28;
+        else
+            break;
+    }
+
+    memset(ml, 0, sizeof(module_layout));
+    ml->rejected = rejected;
+
+    return SONIC_ERR_NOT_FOUND;
+}
+
+/*
+ * stream_samples - Build the sample info table of a module found by
+ * stream_find(). The table and the sample names are allocated from
+ * the arena, a few bytes per sample.
+ * Returns 0, -1 if reading failed or SONIC_ERR_MEMORY.
+ */
+int stream_samples(stream_input *si, module_layout *ml, arena *ar, FILE *log) {
+    char *names;
+    long sample_id;
+    long pos;
+    long len;
+    long i;
+    char *p;
+
+    ml->samples = arena_alloc(ar, ml->sample.cnt * sizeof(sample_info));
+    names = arena_alloc(ar, ml->sample.cnt * 30);
+    if(ml->samples == NULL || names == NULL)
+        return SONIC_ERR_MEMORY;
+    memset(ml->samples, 0, ml->sample.cnt * sizeof(sample_info));
+
+    // The length table is read a window at a time, as in stream_check()
+    for(pos = 0; pos < ml->sample.cnt * 4; pos += len) {
+        len = ml->sample.cnt * 4 - pos < STREAM_WINDOW ? ml->sample.cnt * 4 - pos : STREAM_WINDOW;
+        if(stream_read(si, ml->sample.offset + 4 + pos, si->buf, len) != 0)
+            return -1;
+        for(i = 0; i < len / 4; i++)
+            ml->samples[pos / 4 + i].length = get_long(si->buf + i * 4);
+    }
+
+    // Gather info for samples from instrument entries
+    for(pos = ml->instr.offset; pos < ml->instr.offset + ml->instr.len; pos += len) {
+        len = ml->instr.offset + ml->instr.len - pos;
+        if(len > STREAM_INSTRS)
+            len = STREAM_INSTRS;
+        if(stream_read(si, pos, si->buf, len) != 0)
+            return -1;
+
+        for(p = si->buf; p < si->buf + len; p += 0x98) {
+            if(get_word(p) != 0)
+                continue;
+            // is sampled instrument
+            sample_id = get_word(p + 2);
+            if(sample_id < ml->sample.cnt) {
+                ml->samples[sample_id].length_from_instr = get_word(p + 4);
+                ml->samples[sample_id].repeat_from_instr = get_word(p + 6);
+                ml->samples[sample_id].name_from_instr = memcpy(names + sample_id * 30, p + 0x7a, 30);
+            }
+            else {
+                log_msg(log, "Inconsistent sample id 0x%04lx in instrument %ld! Data ignored.\n",
+                    sample_id, (pos - ml->instr.offset + (p - si->buf)) / 0x98);
+                ml->bad_sample_ids++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * stream_copy - Copy len bytes at offset of a streamed input to the
+ * output, a window at a time.
+ * Returns 0, or -1 if reading failed.
+ */
+int stream_copy(stream_input *si, long offset, long len, out_file *o) {
+    long n;
+
+    for(; len > 0; offset += n, len -= n) {
+        n = len < STREAM_WINDOW ? len : STREAM_WINDOW;
+        if(stream_read(si, offset, si->buf, n) != 0)
+            return -1;
+        out_write(o, si->buf, n);
+    }
+
+    return 0;
+}
+
+/*
+ * stream_section - Write a chunk header and copy the section data.
+ * Returns 0, or -1 if reading failed.
+ */
+int stream_section(stream_input *si, char *id, module_section *sec, out_file *o) {
+    char chunk[8];
+
+    put_chunk(chunk, id, sec->cnt);
+    out_write(o, chunk, 8);
+
+    return stream_copy(si, sec->offset, sec->len, o);
+}
+
+/*
+ * stream_long - Write a big-endian long.
+ */
+void stream_long(s32 v, out_file *o) {
+    char buf[4];
+
+    put_long(buf, v);
+    out_write(o, buf, 4);
+}
+
+/*
+ * stream_write - Write the SOAR conversion of a module in a streamed
+ * input to out_name, in the same layout as soar_pieces(). The output
+ * buffer is as small as the window, the headers and sample tables are
+ * gathered in it.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int stream_write(stream_input *si, module_layout *ml, char *out_name, FILE *log) {
+    static char zero[30];
+    out_file o;
+    char chunk[8];
+    long i;
+    int rc = 0;
+
+    if(out_open(&o, out_name, STREAM_WINDOW) != 0) {
+        log_msg(log, "Cannot open file: %s\n", out_name);
+        return -1;
+    }
+
+    out_write(&o, SOAR_ID, 8);
+    if(stream_section(si, STBL_ID, &ml->song, &o) != 0
+        || stream_section(si, OVTB_ID, &ml->over, &o) != 0
+        || stream_section(si, NTBL_ID, &ml->note, &o) != 0
+        || stream_section(si, INST_ID, &ml->instr, &o) != 0)
+        rc = -1;
+
+    put_chunk(chunk, SD8B_ID, ml->sample.cnt);
+    out_write(&o, chunk, 8);
+    // write lengths, repeats, names, lengths
+    for(i = 0; i < ml->sample.cnt; i++)
+        stream_long(ml->samples[i].length_from_instr, &o);
+    for(i = 0; i < ml->sample.cnt; i++)
+        stream_long(ml->samples[i].repeat_from_instr, &o);
+    for(i = 0; i < ml->sample.cnt; i++)
+        out_write(&o, ml->samples[i].name_from_instr != NULL ? ml->samples[i].name_from_instr : zero, 30);
+    for(i = 0; i < ml->sample.cnt; i++)
+        stream_long(ml->samples[i].length, &o);
+
+    if(rc != 0
+        || stream_copy(si, ml->sample_data_offset, ml->sample.len, &o) != 0
+        || stream_section(si, SYWT_ID, &ml->wave, &o) != 0
+        || stream_section(si, SYAR_ID, &ml->adsr, &o) != 0
+        || stream_section(si, SYAF_ID, &ml->amf, &o) != 0)
+        rc = -1;
+
+    out_write(&o, EDAT_ID, 8);
+    out_write(&o, EDAT_DATA, 0x10);
+
+    if(out_close(&o) != 0 || rc != 0) {
+        log_msg(log, "Write error on file: %s\n", out_name);
+        return -1;
+    }
+
+    log_msg(log, "Conversion written to: %s\n", out_name);
+
+    return 0;
+}
+
+/*
+ * stream_convert - Convert a file with a few KB of memory, whatever its
+ * size: it is searched through a small window, and each module found
+ * is copied section by section into the output through the same
+ * window. Containers are searched like any other file, and the cache
+ * is not used.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int stream_convert(char *in_name, char *out_name, conv_options *opt, conv_result *res, arena *ar, FILE *log) {
+    stream_input si;
+    module_layout ml;
+    char *name;
+    double t0, t1;
+    long offset;
+    long index = 0;
+    long start = 0;
+    int rc = 0;
+
+    arena_reset(ar);
+
+    if(strcmp(in_name, "-") == 0) {
+        log_msg(log, "Cannot seek on standard input, convert a file instead.\n");
+        return -1;
+    }
+
+    if(stream_open(&si, in_name) != 0) {
+        log_msg(log, "Cannot open input file: %s\n", in_name);
+        return -1;
+    }
+
+    si.buf = malloc(STREAM_WINDOW);
+    if(si.buf == NULL || si.size < 0) {
+        log_msg(log, "Cannot read file: %s\n", in_name);
+        free(si.buf);
+        stream_close(&si);
+        return -1;
+    }
+
+    log_msg(log, "Source size=0x%lx\n", si.size);
+
+    for(;;) {
+        t0 = now_us();
+        offset = stream_find(&si, start, &ml);
+        t1 = now_us();
+
+        if(res != NULL) {
+            res->scan_time += t1 - t0;
+            res->bytes_scanned += (offset >= 0 ? offset : si.size) - start;
+            res->rejected += ml.rejected;
+        }
+        if(offset < 0)
+            break;
+
+        log_msg(log, "Found module at 0x%lx\n", offset);
+        rc = stream_samples(&si, &ml, ar, log);
+        if(rc != 0) {
+            if(rc == SONIC_ERR_MEMORY)
+                log_msg(log, "Cannot allocate memory for samples info!\n");
+            rc = -1;
+            break;
+        }
+        print_layout(NULL, &ml, log);
+
+        ++index;
+        name = opt->all ? index_name(out_name, index, ar) : out_name;
+        if(name == NULL || stream_write(&si, &ml, name, log) != 0)
+            rc = -1;
+        else if(res != NULL)
+            count_module(&ml, res);
+
+        if(res != NULL)
+            res->write_time += now_us() - t1;
+
+        if(!opt->all)
+            break;
+
+        start = module_end(&ml);
+    }
+
+    if(si.failed) {
+        log_msg(log, "Read error on file: %s\n", in_name);
+        rc = -1;
+    }
+
+    if(index == 0) {
+        log_msg(log, "Song not found in file: %s\n", in_name);
+        rc = -1;
+    } else if(opt->all) {
+        log_msg(log, "%ld module(s) found in file: %s\n", index, in_name);
+    }
+
+    if(res != NULL)
+        res->bytes_read += si.bytes_read;
+
+    free(si.buf);
+    stream_close(&si);
+
+    return rc;
+}
+
+/*
+ * convert - Do the actual conversion, see convert_input(), or
+ * stream_convert() with opt->low_mem.
+ * Returns 0 if the conversion was written, -1 otherwise.
+ */
+int convert(char *in_name, char *out_name, conv_options *opt, conv_result *res, arena *ar, FILE *log) {
+    conv_input in;
+    int rc;
+
+    if(opt->low_mem)
+        return stream_convert(in_name, out_name, opt, res, ar, log);
+
+    arena_reset(ar);
+
+    if(read_job_input(in_name, 1, &in, res, ar, log) != 0)
+        return -1;
+
+    rc = convert_input(in_name, &in, out_name, opt, res, ar, log);
+    close_input(&in);
+
+    return rc;
+}
+
+/*
+ * make_out_name - Build the output name for an input file in batch mode.
+ * The file part of in_name is appended to out_dir.
+ */
+char *make_out_name(char *out_dir, char *in_name) {
+    char *base;
+    char *p;
+    char *out_name;
+
+    base = in_name;
+    for(p = in_name; *p; p++) {
+        if(*p == '/' || *p == ':')
+            base = p + 1;
+    }
+
+    out_name = malloc(strlen(out_dir) + 1 + strlen(base) + 1);
+    if(out_name != NULL)
+        join_path(out_name, out_dir, base);
+
+    return out_name;
+}
+
+/*
+ * manifest_cmp - Order manifest entries by input name.
+ */
+int manifest_cmp(const void *a, const void *b) {
+    return strcmp(((manifest_entry *)a)->in_name, ((manifest_entry *)b)->in_name);
+}
+
+/*
+ * manifest_load - Read the manifest of the last run.
+ * Each line holds size, modification time, hash, whether the outputs
+ * were numbered, output and input name separated by tabs.
+ * A missing manifest is an empty one.
+ * Returns -1 if out of memory.
+ */
+int manifest_load(manifest *m, char *name) {
+    FILE *f;
+    char line[2200];
+    manifest_entry e;
+    manifest_entry *entries;
+    unsigned long h0, h1;
+    char *out, *in, *p;
+
+    memset(m, 0, sizeof(manifest));
+
+    f = fopen(name, "r");
+    if(f == NULL)
+        return 0;
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        p = line + strlen(line);
+        while(p > line && (p[-1] == '\n' || p[-1] == '\r'))
+            *--p = 0;
+
+        memset(&e, 0, sizeof(e));
+        if(sscanf(line, "%ld\t%ld\t%8lx%8lx\t%d\t", &e.size, &e.mtime, &h0, &h1, &e.numbered) != 5)
+            continue;
+        e.hash[0] = (u32)h0;
+        e.hash[1] = (u32)h1;
+        out = strchr(line, '\t');
+        out = out ? strchr(out + 1, '\t') : NULL;
+        out = out ? strchr(out + 1, '\t') : NULL;
+        out = out ? strchr(out + 1, '\t') : NULL;
+        in = out ? strchr(out + 1, '\t') : NULL;
+        if(in == NULL)
+            continue;
+        *in++ = 0;
+        out++;
+
+        if(m->cnt == m->max) {
+            m->max = m->max ? m->max * 2 : 256;
+            entries = realloc(m->entries, m->max * sizeof(manifest_entry));
+            if(entries == NULL) {
+                fclose(f);
+                return -1;
+            }
+            m->entries = entries;
+        }
+
+        e.out_name = copy_string(out);
+        e.in_name = copy_string(in);
+        if(e.out_name == NULL || e.in_name == NULL) {
+            fclose(f);
+            return -1;
+        }
+        m->entries[m->cnt++] = e;
+    }
+
+    fclose(f);
+
+    qsort(m->entries, m->cnt, sizeof(manifest_entry), manifest_cmp);
+
+    return 0;
+}
+
+/*
+ * manifest_find - Look up an input file in the manifest.
+ */
+manifest_entry *manifest_find(manifest *m, char *in_name) {
+    manifest_entry key;
+
+    if(m->cnt == 0)
+        return NULL;
+
+    key.in_name = in_name;
+    return bsearch(&key, m->entries, m->cnt, sizeof(manifest_entry), manifest_cmp);
+}
+
+/*
+ * manifest_save - Write the manifest for the next run: every file of
+ * this batch that was converted or skipped, and all files of the last
+ * run that were not part of this batch.
+ * Returns -1 if the manifest cannot be written.
+ */
+int manifest_save(batch *b) {
+    FILE *f;
+    batch_job *job;
+    manifest_entry *e;
+    long i;
+    int rc = 0;
+
+    f = fopen(b->manifest_name, "w");
+    if(f == NULL)
+        return -1;
+
+    for(i = 0; i < b->job_cnt; i++) {
+        job = &b->jobs[i];
+        e = manifest_find(&b->last, job->in_name);
+        if(e != NULL)
+            e->used = 1;
+        if(job->rc != 0 || job->out_name == NULL)
+            continue;
+        fprintf(f, "%ld\t%ld\t%08lx%08lx\t%d\t%s\t%s\n", job->size, job->mtime,
+            (unsigned long)job->res.hash[0], (unsigned long)job->res.hash[1], job->res.numbered, job->out_name, job->in_name);
+    }
+
+    for(i = 0; i < b->last.cnt; i++) {
+        e = &b->last.entries[i];
+        if(!e->used)
+            fprintf(f, "%ld\t%ld\t%08lx%08lx\t%d\t%s\t%s\n", e->size, e->mtime,
+                (unsigned long)e->hash[0], (unsigned long)e->hash[1], e->numbered, e->out_name, e->in_name);
+    }
+
+    if(ferror(f))
+        rc = -1;
+    if(fclose(f) != 0)
+        rc = -1;
+
+    return rc;
+}
+
+/*
+ * manifest_free - Release the entries of a manifest.
+ */
+void manifest_free(manifest *m) {
+    long i;
+
+    for(i = 0; i < m->cnt; i++) {
+        free(m->entries[i].in_name);
+        free(m->entries[i].out_name);
+    }
+    free(m->entries);
+    memset(m, 0, sizeof(manifest));
+}
+
+/*
+ * unchanged - Check if a file of an incremental batch can be skipped:
+ * its output still exists and it has the same size and time as in the
+ * last run. If only the time differs, the file is skipped if its
+ * contents have the same hash. Numbered outputs are looked up by the
+ * first name, and with opt.all a file converted without it is redone,
+ * as it may contain more modules.
+ */
+int unchanged(batch *b, batch_job *job, arena *ar) {
+    manifest_entry *e;
+    conv_input in;
+    struct stat st;
+    char *out_check;
+
+    e = manifest_find(&b->last, job->in_name);
+    if(e == NULL || e->size != job->size || strcmp(e->out_name, job->out_name) != 0
+        || (b->opt.all && !e->numbered))
+        return 0;
+
+    out_check = e->numbered ? index_name(job->out_name, 1, ar) : job->out_name;
+    if(out_check == NULL || stat(out_check, &st) == -1)
+        return 0;
+
+    job->res.hash[0] = e->hash[0];
+    job->res.hash[1] = e->hash[1];
+    job->res.numbered = e->numbered;
+    if(e->mtime == job->mtime)
+        return 1;
+
+    if(open_input(job->in_name, 1, &in, ar, NULL) != 0)
+        return 0;
+    sonic_hash(in.dat, in.size, job->res.hash);
+    close_input(&in);
+
+    return job->res.hash[0] == e->hash[0] && job->res.hash[1] == e->hash[1];
+}
+
+/*
+ * start_job - Set up the output name of a job and, in an incremental
+ * batch, check whether it is unchanged since the last run.
+ * Returns 1 if the job can be skipped, 0 if it must be converted and
+ * -1 on errors.
+ */
+int start_job(batch *b, batch_job *job, arena *ar, FILE *log) {
+    struct stat st;
+
+    job->out_name = make_out_name(b->out_dir, job->in_name);
+    if(job->out_name == NULL) {
+        log_msg(log, "Cannot allocate memory for output name of: %s\n", job->in_name);
+        return -1;
+    }
+
+    log_msg(log, "\n%s\n", job->in_name);
+
+    if(b->manifest_name != NULL && stat(job->in_name, &st) == 0) {
+        job->size = (long)st.st_size;
+        job->mtime = (long)st.st_mtime;
+
+        arena_reset(ar);
+        if(unchanged(b, job, ar)) {
+            log_msg(log, "Unchanged since last run: %s\n", job->in_name);
+            job->skipped = 1;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * convert_job - Convert one input file of a batch into the output
+ * directory, unless it is unchanged since the last incremental run.
+ */
+int convert_job(batch *b, batch_job *job, arena *ar, FILE *log) {
+    int rc;
+
+    rc = start_job(b, job, ar, log);
+    if(rc != 0)
+        return rc < 0 ? rc : 0;
+
+    return convert(job->in_name, job->out_name, &b->opt, &job->res, ar, log);
+}
+
+/*
+ * print_csv_name - Print a file name as CSV field, quoted if needed.
+ */
+void print_csv_name(char *name, FILE *out) {
+    char *p;
+
+    if(strpbrk(name, ",\"\r\n") == NULL) {
+        fputs(name, out);
+        return;
+    }
+
+    fputc('"', out);
+    for(p = name; *p; p++) {
+        if(*p == '"')
+            fputc('"', out);
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * scan_header - Print the column names of the scan records.
+ */
+void scan_header(FILE *out) {
+    fprintf(out, "file,status,offset,song,over,note,inst,wave,adsr,amf,smpl,smpl_len\n");
+}
+
+/*
+ * scan_modules - Print a CSV record for the modules in a buffer, or a
+ * not_found record. The file column is name.
+ */
+void scan_modules(char *dat, long size, char *name, conv_options *opt, arena *ar, FILE *out) {
+    module_search ms;
+    module_layout ml;
+    long offset;
+
+    start_search(&ms, dat, size, opt->scan_threads, ar);
+    offset = next_module(&ms, 0, &ml, NULL);
+    if(offset < 0) {
+        print_csv_name(name, out);
+        fprintf(out, ",not_found,,,,,,,,,,\n");
+    }
+
+    while(offset >= 0) {
+        print_csv_name(name, out);
+        fprintf(out, ",ok,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n", offset,
+            ml.song.cnt, ml.over.cnt, ml.note.cnt, ml.instr.cnt,
+            ml.wave.cnt, ml.adsr.cnt, ml.amf.cnt, ml.sample.cnt, ml.sample.len);
+
+        if(!opt->all)
+            break;
+
+        offset = next_module(&ms, module_end(&ml), &ml, NULL);
+    }
+}
+
+/* state of scanning the members of a container */
+typedef struct {
+    char *in_name;
+    conv_options *opt;
+    arena *ar;
+    FILE *out;
+} member_scan;
+
+/*
+ * scan_member - Print the records of one member of a container, named
+ * "file/member" in the file column.
+ */
+int scan_member(char *name, char *dat, long size, void *ctx) {
+    member_scan *ms = ctx;
+    char *full;
+
+    full = arena_alloc(ms->ar, strlen(ms->in_name) + 1 + strlen(name) + 1);
+    if(full == NULL)
+        return 1;
+    sprintf(full, "%s/%s", ms->in_name, name);
+
+    if(dat == NULL) {
+        print_csv_name(full, ms->out);
+        fprintf(ms->out, ",error,,,,,,,,,,\n");
+    } else {
+        scan_modules(dat, size, full, ms->opt, ms->ar, ms->out);
+    }
+
+    return 0;
+}
+
+/*
+ * scan_file - Look for a module in a file without converting it and
+ * print one CSV record for the file to out. The status column is "ok",
+ * "not_found" or "error" if the file cannot be read. With opt->all
+ * there is a record for every module found. Members of containers get
+ * their own records.
+ * Returns -1 if the file cannot be read, 0 otherwise.
+ */
+int scan_file(char *in_name, conv_options *opt, arena *ar, FILE *out) {
+    conv_input in;
+    member_scan ms;
+
+    arena_reset(ar);
+
+    if(open_input(in_name, 1, &in, ar, NULL) != 0) {
+        print_csv_name(in_name, out);
+        fprintf(out, ",error,,,,,,,,,,\n");
+        return -1;
+    }
+
+    ms.in_name = in_name;
+    ms.opt = opt;
+    ms.ar = ar;
+    ms.out = out;
+
+    if(container_type(in.dat, in.size) == CONTAINER_NONE
+        || container_members(in.dat, in.size, scan_member, &ms, ar) <= 0)
+        scan_modules(in.dat, in.size, in_name, opt, ar, out);
+
+    close_input(&in);
+
+    return 0;
+}
+
+/*
+ * run_job - Convert or scan one file of a batch, printing to log.
+ */
+int run_job(batch *b, batch_job *job, arena *ar, FILE *log) {
+    if(b->scan)
+        return scan_file(job->in_name, &b->opt, ar, log);
+
+    return convert_job(b, job, ar, log);
+}
+
+/*
+ * add_job - Append a copy of in_name to the batch job list.
+ */
+int add_job(batch *b, char *in_name) {
+    batch_job *jobs;
+    long max;
+
+    if(b->job_cnt == b->job_max) {
+        max = b->job_max ? b->job_max * 2 : 64;
+        jobs = realloc(b->jobs, max * sizeof(batch_job));
+        if(jobs == NULL)
+            return -1;
+        b->jobs = jobs;
+        b->job_max = max;
+    }
+
+    memset(&b->jobs[b->job_cnt], 0, sizeof(batch_job));
+    b->jobs[b->job_cnt].in_name = malloc(strlen(in_name) + 1);
+    if(b->jobs[b->job_cnt].in_name == NULL)
+        return -1;
+    strcpy(b->jobs[b->job_cnt].in_name, in_name);
+    b->job_cnt++;
+
+    return 0;
+}
+
+/*
+ * read_list - Add all files named in a list file, one per line.
+ * A list name of "-" reads the names from standard input.
+ */
+int read_list(batch *b, char *list_name) {
+    FILE *f_list;
+    char line[1024];
+    size_t len;
+    int rc = 0;
+
+    if(strcmp(list_name, "-") == 0)
+        f_list = stdin;
+    else
+        f_list = fopen(list_name, "r");
+
+    if(f_list == NULL) {
+        printf("Cannot open list file: %s\n", list_name);
+        return -1;
+    }
+
+    while(rc == 0 && fgets(line, sizeof(line), f_list) != NULL) {
+        len = strlen(line);
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = 0;
+        if(len > 0)
+            rc = add_job(b, line);
+    }
+
+    if(f_list != stdin)
+        fclose(f_list);
+
+    if(rc != 0)
+        printf("Cannot allocate memory for file list!\n");
+
+    return rc;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * pack_wait - Wait until job is the next to append to the archive.
+ */
+void pack_wait(batch *b, batch_job *job) {
+    pthread_mutex_lock(&b->lock);
+    while(b->pack_turn != job - b->jobs)
+        pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * pack_done - Let the next job append to the archive.
+ */
+void pack_done(batch *b) {
+    pthread_mutex_lock(&b->lock);
+    b->pack_turn++;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * pack_job - Convert one file of a batch in a worker thread for the
+ * archive. The conversions are collected and only appended once all
+ * files before are in, so the archive is the same with any number of
+ * threads.
+ */
+int pack_job(batch *b, batch_job *job, arena *ar, FILE *log) {
+    conv_options opt;
+    write_list writes;
+    conv_input in;
+    double t0;
+    int have_input = 0;
+    int rc;
+
+    opt = b->opt;
+    opt.defer = &writes;
+    writes.head = NULL;
+    writes.tail = &writes.head;
+
+    arena_reset(ar);
+    rc = start_job(b, job, ar, log);
+    if(rc == 0) {
+        rc = read_job_input(job->in_name, 1, &in, &job->res, ar, log);
+        have_input = rc == 0;
+        if(have_input)
+            rc = convert_input(job->in_name, &in, job->out_name, &opt, &job->res, ar, log);
+    }
+    else if(rc > 0)
+        rc = 0;
+
+    pack_wait(b, job);
+    t0 = now_us();
+    if(flush_writes(&writes, ar, log) != 0)
+        rc = -1;
+    job->res.write_time += now_us() - t0;
+    pack_done(b);
+
+    if(have_input)
+        close_input(&in);
+
+    return rc;
+}
+
+/*
+ * batch_worker - Thread taking the next unclaimed job from the batch
+ * until none are left. Messages are captured per job, so they can be
+ * printed in input order no matter which thread finishes first.
+ */
+void *batch_worker(void *arg) {
+    batch *b = arg;
+    batch_job *job;
+    arena ar;
+    FILE *log;
+
+    arena_init(&ar);
+
+    for(;;) {
+        pthread_mutex_lock(&b->lock);
+        job = b->next_job < b->job_cnt ? &b->jobs[b->next_job++] : NULL;
+        pthread_mutex_unlock(&b->lock);
+        if(job == NULL)
+            break;
+
+        log = open_memstream(&job->log, &job->log_size);
+        if(log != NULL) {
+            job->rc = b->opt.pack != NULL ? pack_job(b, job, &ar, log) : run_job(b, job, &ar, log);
+            fclose(log);
+        }
+        else {
+            job->rc = -1;
+            // Later jobs must not wait for this one
+            if(b->opt.pack != NULL) {
+                pack_wait(b, job);
+                pack_done(b);
+            }
+        }
+
+        pthread_mutex_lock(&b->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    arena_free(&ar);
+
+    return NULL;
+}
+
+/*
+ * print_job_logs - Print the messages of every job in input order, as
+ * soon as the job is done.
+ */
+void print_job_logs(batch *b) {
+    batch_job *job;
+    long i;
+
+    for(i = 0; i < b->job_cnt; i++) {
+        job = &b->jobs[i];
+        pthread_mutex_lock(&b->lock);
+        while(!job->done)
+            pthread_cond_wait(&b->cond, &b->lock);
+        pthread_mutex_unlock(&b->lock);
+
+        if(job->log != NULL)
+            fwrite(job->log, 1, job->log_size, stdout);
+        free(job->log);
+        job->log = NULL;
+    }
+}
+
+/*
+ * run_threaded - Convert the batch with thread_cnt worker threads.
+ * Returns -1 if no thread could be started.
+ */
+int run_threaded(batch *b, long thread_cnt) {
+    pthread_t *threads;
+    long started;
+    long i;
+
+    threads = malloc(thread_cnt * sizeof(pthread_t));
+    if(threads == NULL)
+        return -1;
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->next_job = 0;
+    b->pack_turn = 0;
+
+    for(started = 0; started < thread_cnt; started++) {
+        if(pthread_create(&threads[started], NULL, batch_worker, b) != 0)
+            break;
+    }
+
+    if(started > 0)
+        print_job_logs(b);
+
+    for(i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(threads);
+
+    return started > 0 ? 0 : -1;
+}
+
+/*
+ * pipe_wait - Back off while waiting for another pipeline stage. Spin
+ * for a short while, then sleep, so an idle stage takes no CPU.
+ */
+void pipe_wait(long *spins) {
+    struct timespec ts;
+
+    if(++*spins < 64) {
+        sched_yield();
+        return;
+    }
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * pipe_next - Wait until the stage before has handed on more than pos
+ * files, cnt and done are its counter and end flag.
+ * Returns 0 if it is done and there are no more files.
+ */
+int pipe_next(long pos, long *cnt, int *done) {
+    long spins = 0;
+
+    for(;;) {
+        if(PIPE_LOAD(cnt) > pos)
+            return 1;
+        if(PIPE_LOAD(done))
+            return PIPE_LOAD(cnt) > pos;
+        pipe_wait(&spins);
+    }
+}
+
+/*
+ * pipe_reader - First pipeline stage: claim the next job of the batch
+ * and read the whole file into a free slot.
+ */
+void *pipe_reader(void *arg) {
+    pipeline *pl = arg;
+    batch *b = pl->b;
+    batch_job *job;
+    pipe_slot *slot;
+    long spins;
+    int rc;
+
+    for(;;) {
+        spins = 0;
+        while(pl->read_cnt - PIPE_LOAD(&pl->write_cnt) >= PIPE_SLOTS)
+            pipe_wait(&spins);
+
+        pthread_mutex_lock(&b->lock);
+        job = b->next_job < b->job_cnt ? &b->jobs[b->next_job++] : NULL;
+        pthread_mutex_unlock(&b->lock);
+        if(job == NULL)
+            break;
+
+        slot = &pl->slots[pl->read_cnt % PIPE_SLOTS];
+        arena_reset(&slot->ar);
+        slot->job = job;
+        slot->convert = 0;
+        slot->rc = -1;
+
+        slot->log = open_memstream(&job->log, &job->log_size);
+        if(slot->log != NULL) {
+            rc = start_job(b, job, &slot->ar, slot->log);
+            // Really read the file, a mapping would be loaded by the scanner
+            if(rc == 0)
+                rc = read_job_input(job->in_name, 0, &slot->in, &job->res, &slot->ar, slot->log);
+            slot->rc = rc < 0 ? -1 : 0;
+            slot->convert = rc == 0;
+        }
+
+        PIPE_STORE(&pl->read_cnt, pl->read_cnt + 1);
+    }
+
+    PIPE_STORE(&pl->read_done, 1);
+
+    return NULL;
+}
+
+/*
+ * pipe_scanner - Second pipeline stage: find and parse the modules of a
+ * file that was read, collecting the conversions in the write list.
+ */
+void *pipe_scanner(void *arg) {
+    pipeline *pl = arg;
+    pipe_slot *slot;
+    batch_job *job;
+
+    while(pipe_next(pl->scan_cnt, &pl->read_cnt, &pl->read_done)) {
+        slot = &pl->slots[pl->scan_cnt % PIPE_SLOTS];
+        job = slot->job;
+        if(slot->convert)
+            slot->rc = convert_input(job->in_name, &slot->in, job->out_name, &slot->opt, &job->res, &slot->ar, slot->log);
+
+        PIPE_STORE(&pl->scan_cnt, pl->scan_cnt + 1);
+    }
+
+    PIPE_STORE(&pl->scan_done, 1);
+
+    return NULL;
+}
+
+/*
+ * pipe_writer - Last pipeline stage: write the conversions of a file,
+ * release its slot and mark the job as done.
+ */
+void *pipe_writer(void *arg) {
+    pipeline *pl = arg;
+    batch *b = pl->b;
+    pipe_slot *slot;
+    batch_job *job;
+    double t0;
+
+    while(pipe_next(pl->write_cnt, &pl->scan_cnt, &pl->scan_done)) {
+        slot = &pl->slots[pl->write_cnt % PIPE_SLOTS];
+        job = slot->job;
+        if(slot->convert) {
+            t0 = now_us();
+            if(flush_writes(&slot->writes, &slot->ar, slot->log) != 0)
+                slot->rc = -1;
+            job->res.write_time += now_us() - t0;
+            close_input(&slot->in);
+        }
+        if(slot->log != NULL)
+            fclose(slot->log);
+
+        pthread_mutex_lock(&b->lock);
+        job->rc = slot->rc;
+        job->done = 1;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+
+        PIPE_STORE(&pl->write_cnt, pl->write_cnt + 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * start_pipeline - Start the writer, scanner and reader thread of a
+ * pipeline. A stage that cannot be started ends the stages after it.
+ * Returns -1 if the reader is not running.
+ */
+int start_pipeline(pipeline *pl) {
+    pl->running[2] = pthread_create(&pl->threads[2], NULL, pipe_writer, pl) == 0;
+    if(!pl->running[2])
+        return -1;
+
+    pl->running[1] = pthread_create(&pl->threads[1], NULL, pipe_scanner, pl) == 0;
+    if(!pl->running[1]) {
+        PIPE_STORE(&pl->scan_done, 1);
+        return -1;
+    }
+
+    pl->running[0] = pthread_create(&pl->threads[0], NULL, pipe_reader, pl) == 0;
+    if(!pl->running[0]) {
+        PIPE_STORE(&pl->read_done, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * run_pipelined - Convert the batch with pipe_cnt pipelines, each with
+ * a reader, a scanner and a writer thread, so reading the next files
+ * overlaps with scanning and writing the current ones.
+ * Returns -1 if no pipeline could be started.
+ */
+int run_pipelined(batch *b, long pipe_cnt) {
+    pipeline *pipes;
+    pipe_slot *slot;
+    long started = 0;
+    long i;
+    int j;
+
+    pipes = calloc(pipe_cnt, sizeof(pipeline));
+    if(pipes == NULL)
+        return -1;
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->next_job = 0;
+
+    for(i = 0; i < pipe_cnt; i++) {
+        pipes[i].b = b;
+        for(j = 0; j < PIPE_SLOTS; j++) {
+            slot = &pipes[i].slots[j];
+            arena_init(&slot->ar);
+            slot->opt = b->opt;
+            slot->opt.defer = &slot->writes;
+            slot->writes.head = NULL;
+            slot->writes.tail = &slot->writes.head;
+        }
+        if(start_pipeline(&pipes[i]) == 0)
+            started++;
+    }
+
+    if(started > 0)
+        print_job_logs(b);
+
+    for(i = 0; i < pipe_cnt; i++) {
+        for(j = 0; j < 3; j++) {
+            if(pipes[i].running[j])
+                pthread_join(pipes[i].threads[j], NULL);
+        }
+        for(j = 0; j < PIPE_SLOTS; j++)
+            arena_free(&pipes[i].slots[j].ar);
+    }
+
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(pipes);
+
+    return started > 0 ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+/*
+ * uring_free - Release a ring set up by uring_init(), also a partly
+ * set up one.
+ */
+void uring_free(uring *u) {
+    if(u->sqes != NULL)
+        munmap(u->sqes, u->sqes_size);
+    if(u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if(u->sq_ring != NULL)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if(u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(uring));
+    u->fd = -1;
+}
+
+/*
+ * uring_map - Map a part of a ring shared with the kernel.
+ * Returns NULL if it cannot be mapped.
+ */
+void *uring_map(int fd, size_t size, long offset) {
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * uring_init - Set up a ring for entries operations at a time.
+ * Returns -1 if io_uring is not available, e.g. because it is turned
+ * off, or the kernel is older than 5.6 and lacks the file operations.
+ */
+int uring_init(uring *u, unsigned entries) {
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+
+    memset(u, 0, sizeof(uring));
+    memset(&p, 0, sizeof(p));
+
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(u->fd < 0 || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        uring_free(u);
+        return -1;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = uring_map(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+    if(u->sq_ring != NULL && (p.features & IORING_FEAT_SINGLE_MMAP))
+        u->cq_ring = u->sq_ring;
+    else if(u->sq_ring != NULL)
+        u->cq_ring = uring_map(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if(u->cq_ring != NULL)
+        u->sqes = uring_map(u->fd, u->sqes_size, IORING_OFF_SQES);
+    if(u->sqes == NULL) {
+        uring_free(u);
+        return -1;
+    }
+
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->entries = p.sq_entries;
+
+    return 0;
+}
+
+/*
+ * uring_run - Submit all prepared operations and wait until they are
+ * complete. The result of each goes to the int its user_data points to.
+ * Returns -1 if the ring failed, the results not stored stay at
+ * -ECANCELED then.
+ */
+int uring_run(uring *u) {
+    struct io_uring_cqe *cqe;
+    unsigned total;
+    unsigned submit;
+    unsigned done = 0;
+    unsigned head;
+    unsigned tail;
+    long n;
+
+    total = u->queued;
+    if(total == 0)
+        return 0;
+
+    // Only this thread writes the tail, the kernel reads it
+    __atomic_store_n(u->sq_tail, *u->sq_tail + total, __ATOMIC_RELEASE);
+    u->queued = 0;
+
+    submit = total;
+    while(done < total) {
+        n = syscall(__NR_io_uring_enter, u->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(n < 0 && errno != EINTR)
+            return -1;
+        if(n > 0)
+            submit -= n;
+
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            *(int *)(unsigned long)cqe->user_data = cqe->res;
+            done++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/*
+ * uring_prep - Prepare an operation on fd, its result goes to *res.
+ * A full ring is run first to make room.
+ */
+struct io_uring_sqe *uring_prep(uring *u, int op, int fd, int *res) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if(u->queued == u->entries)
+        uring_run(u);
+
+    idx = (*u->sq_tail + u->queued) & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)res;
+    u->sq_array[idx] = idx;
+    u->queued++;
+
+    *res = -ECANCELED;
+
+    return sqe;
+}
+
+/*
+ * uring_open - Prepare opening name with flags and mode.
+ */
+void uring_open(uring *u, char *name, int flags, int mode, int *res) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_prep(u, IORING_OP_OPENAT, AT_FDCWD, res);
+    sqe->addr = (unsigned long)name;
+    sqe->open_flags = flags;
+    sqe->len = mode;
+}
+
+/*
+ * uring_close_all - Close the input files of a round.
+ */
+void uring_close_all(uring *u, uring_file *files, long cnt) {
+    long i;
+
+    for(i = 0; i < cnt; i++) {
+        if(files[i].fd >= 0)
+            uring_prep(u, IORING_OP_CLOSE, files[i].fd, &files[i].open_res);
+        files[i].fd = -1;
+    }
+    uring_run(u);
+}
+
+/*
+ * uring_read_files - Start the jobs of a round and read their input
+ * files into the arena, all files at once: first they are opened and
+ * their sizes looked up, then read, then closed.
+ */
+void uring_read_files(uring_worker *w, uring_file *files, long cnt, arena *ar) {
+    uring_file *f;
+    struct io_uring_sqe *sqe;
+    double t0;
+    double t;
+    long total = 0;
+    long more;
+    long i;
+    int rc;
+
+    for(i = 0; i < cnt; i++) {
+        f = &files[i];
+        memset(&f->in, 0, sizeof(conv_input));
+        f->writes.head = NULL;
+        f->writes.tail = &f->writes.head;
+        f->fd = -1;
+        f->rc = -1;
+        f->convert = 0;
+        f->ready = 0;
+        f->out_size = 0;
+
+        f->log = open_memstream(&f->job->log, &f->job->log_size);
+        if(f->log == NULL)
+            continue;
+
+        // start_job() may reset the arena, so the round allocates after it
+        rc = start_job(w->b, f->job, ar, f->log);
+        f->rc = rc < 0 ? -1 : 0;
+        if(rc != 0)
+            continue;
+
+        // Standard input is read as before
+        if(strcmp(f->job->in_name, "-") == 0) {
+            f->rc = read_job_input(f->job->in_name, 0, &f->in, &f->job->res, ar, f->log);
+            f->convert = f->ready = f->rc == 0;
+            continue;
+        }
+
+        f->convert = 1;
+    }
+    arena_reset(ar);
+
+    t0 = now_us();
+    for(i = 0; i < cnt; i++) {
+        f = &files[i];
+        if(!f->convert || f->ready)
+            continue;
+        uring_open(&w->u, f->job->in_name, O_RDONLY, 0, &f->open_res);
+        sqe = uring_prep(&w->u, IORING_OP_STATX, AT_FDCWD, &f->stat_res);
+        sqe->addr = (unsigned long)f->job->in_name;
+        sqe->len = STATX_SIZE;
+        sqe->off = (unsigned long)&f->stx;
+    }
+    uring_run(&w->u);
+
+    for(i = 0; i < cnt; i++) {
+        f = &files[i];
+        if(!f->convert || f->ready)
+            continue;
+        f->fd = f->open_res >= 0 ? f->open_res : -1;
+        if(f->fd < 0 || f->stat_res < 0) {
+            log_msg(f->log, "Cannot open input file: %s\n", f->job->in_name);
+            f->convert = 0;
+            f->rc = -1;
+            continue;
+        }
+
+        f->in.size = (long)f->stx.stx_size;
+        log_msg(f->log, "Source size=0x%lx\n", f->in.size);
+        f->in.dat = arena_alloc(ar, f->in.size);
+        if(f->in.dat == NULL) {
+            log_msg(f->log, "Cannot allocate memory for file: %s\n", f->job->in_name);
+            f->convert = 0;
+            f->rc = -1;
+            continue;
+        }
+        f->got = 0;
+        total += f->in.size;
+    }
+
+    // Repeat for the files that were read only partly
+    do {
+        more = 0;
+        for(i = 0; i < cnt; i++) {
+            f = &files[i];
+            if(!f->convert || f->ready || f->got >= f->in.size)
+                continue;
+            sqe = uring_prep(&w->u, IORING_OP_READ, f->fd, &f->read_res);
+            sqe->addr = (unsigned long)(f->in.dat + f->got);
+            sqe->len = f->in.size - f->got;
+            sqe->off = f->got;
+            more++;
+        }
+        uring_run(&w->u);
+
+        for(i = 0; more > 0 && i < cnt; i++) {
+            f = &files[i];
+            if(!f->convert || f->ready || f->got >= f->in.size)
+                continue;
+            if(f->read_res <= 0) {
+                log_msg(f->log, "Read failed. Expected 0x%08lx, got 0x%08lx bytes.\n", f->in.size, f->got);
+                f->convert = 0;
+                f->rc = -1;
+            }
+            else
+                f->got += f->read_res;
+        }
+    } while(more > 0);
+
+    uring_close_all(&w->u, files, cnt);
+    t = now_us() - t0;
+
+    // The time of the round is shared out by size
+    for(i = 0; i < cnt; i++) {
+        f = &files[i];
+        if(!f->convert || f->ready)
+            continue;
+        log_msg(f->log, "Read 0x%lx bytes\n", f->in.size);
+        f->job->res.read_time += total > 0 ? t * f->in.size / total : t / cnt;
+        f->job->res.bytes_read += f->in.size;
+        f->ready = 1;
+    }
+}
+
+/*
+ * uring_write_outs - Write the output files of a round, all at once:
+ * first they are created, then written, then closed.
+ */
+void uring_write_outs(uring *u, uring_out *outs, long cnt) {
+    uring_out *o;
+    struct io_uring_sqe *sqe;
+    long written;
+    long more;
+    long i;
+
+    for(i = 0; i < cnt; i++)
+        uring_open(u, outs[i].w->out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666, &outs[i].open_res);
+    uring_run(u);
+
+    for(i = 0; i < cnt; i++)
+        outs[i].fd = outs[i].open_res >= 0 ? outs[i].open_res : -1;
+
+    // Repeat for the files that were written only partly
+    do {
+        more = 0;
+        for(i = 0; i < cnt; i++) {
+            o = &outs[i];
+            if(o->fd < 0 || o->failed || o->left == 0)
+                continue;
+            sqe = uring_prep(u, IORING_OP_WRITEV, o->fd, &o->write_res);
+            sqe->addr = (unsigned long)&o->iov[o->iov_first];
+            sqe->len = o->w->piece_cnt - o->iov_first;
+            sqe->off = o->written;
+            more++;
+        }
+        uring_run(u);
+
+        for(i = 0; more > 0 && i < cnt; i++) {
+            o = &outs[i];
+            if(o->fd < 0 || o->failed || o->left == 0)
+                continue;
+            if(o->write_res <= 0) {
+                o->failed = 1;
+                continue;
+            }
+            o->written += o->write_res;
+            o->left -= o->write_res;
+            // Skip whatever was written, in case of a short write
+            written = o->write_res;
+            while(o->iov_first < o->w->piece_cnt && (size_t)written >= o->iov[o->iov_first].iov_len) {
+                written -= o->iov[o->iov_first].iov_len;
+                o->iov_first++;
+            }
+            if(o->iov_first < o->w->piece_cnt) {
+                o->iov[o->iov_first].iov_base = (char *)o->iov[o->iov_first].iov_base + written;
+                o->iov[o->iov_first].iov_len -= written;
+            }
+        }
+    } while(more > 0);
+
+    for(i = 0; i < cnt; i++) {
+        if(outs[i].fd >= 0)
+            uring_prep(u, IORING_OP_CLOSE, outs[i].fd, &outs[i].close_res);
+    }
+    uring_run(u);
+}
+
+/*
+ * uring_write_files - Write the conversions of a round. With a cache
+ * they are written one by one as before, since the cache is looked up
+ * and updated for each.
+ */
+void uring_write_files(uring_worker *w, uring_file *files, long cnt, arena *ar) {
+    uring_file *f;
+    uring_out *outs = NULL;
+    uring_out *o;
+    pending_write *pw;
+    double t0;
+    double t;
+    long out_cnt = 0;
+    long total = 0;
+    long i;
+    int j;
+
+    t0 = now_us();
+
+    for(i = 0; i < cnt; i++) {
+        for(pw = files[i].writes.head; pw != NULL; pw = pw->next)
+            out_cnt++;
+    }
+    if(w->opt.cache_dir == NULL && out_cnt > 0)
+        outs = arena_alloc(ar, out_cnt * sizeof(uring_out));
+
+    if(outs == NULL) {
+        for(i = 0; i < cnt; i++) {
+            f = &files[i];
+            t = now_us();
+            if(f->writes.head != NULL && flush_writes(&f->writes, ar, f->log) != 0)
+                f->rc = -1;
+            f->job->res.write_time += now_us() - t;
+        }
+        return;
+    }
+
+    memset(outs, 0, out_cnt * sizeof(uring_out));
+    o = outs;
+    for(i = 0; i < cnt; i++) {
+        for(pw = files[i].writes.head; pw != NULL; pw = pw->next, o++) {
+            o->w = pw;
+            o->f = &files[i];
+            for(j = 0; j < pw->piece_cnt; j++) {
+                o->iov[j].iov_base = pw->pieces[j].base;
+                o->iov[j].iov_len = pw->pieces[j].len;
+                o->left += pw->pieces[j].len;
+            }
+            files[i].out_size += o->left;
+            total += o->left;
+        }
+        files[i].writes.head = NULL;
+        files[i].writes.tail = &files[i].writes.head;
+    }
+
+    uring_write_outs(&w->u, outs, out_cnt);
+    t = now_us() - t0;
+
+    for(i = 0; i < out_cnt; i++) {
+        o = &outs[i];
+        if(o->fd < 0) {
+            log_msg(o->f->log, "Cannot open file: %s\n", o->w->out_name);
+            o->f->rc = -1;
+        }
+        else if(o->failed || o->close_res < 0) {
+            log_msg(o->f->log, "Write error on file: %s\n", o->w->out_name);
+            o->f->rc = -1;
+        }
+    }
+
+    // The time of the round is shared out by size
+    for(i = 0; i < cnt; i++) {
+        f = &files[i];
+        if(f->out_size > 0)
+            f->job->res.write_time += t * f->out_size / total;
+    }
+}
+
+/*
+ * uring_round - Convert the files of a round: read them all, convert
+ * one after another, write all conversions and finish the jobs.
+ */
+void uring_round(uring_worker *w, long cnt, arena *ar) {
+    uring_file *f;
+    batch *b = w->b;
+    long i;
+
+    uring_read_files(w, w->files, cnt, ar);
+
+    for(i = 0; i < cnt; i++) {
+        f = &w->files[i];
+        if(!f->ready)
+            continue;
+        w->opt.defer = &f->writes;
+        f->rc = convert_input(f->job->in_name, &f->in, f->job->out_name, &w->opt, &f->job->res, ar, f->log);
+    }
+
+    uring_write_files(w, w->files, cnt, ar);
+
+    for(i = 0; i < cnt; i++) {
+        f = &w->files[i];
+        close_input(&f->in);
+        if(f->log != NULL)
+            fclose(f->log);
+
+        pthread_mutex_lock(&b->lock);
+        f->job->rc = f->rc;
+        f->job->done = 1;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+/*
+ * uring_thread - Worker claiming the next files of the batch, a round
+ * at a time, until none are left.
+ */
+void *uring_thread(void *arg) {
+    uring_worker *w = arg;
+    batch *b = w->b;
+    arena ar;
+    long cnt;
+
+    arena_init(&ar);
+
+    for(;;) {
+        pthread_mutex_lock(&b->lock);
+        for(cnt = 0; cnt < w->round && b->next_job < b->job_cnt; cnt++)
+            w->files[cnt].job = &b->jobs[b->next_job++];
+        pthread_mutex_unlock(&b->lock);
+        if(cnt == 0)
+            break;
+
+        uring_round(w, cnt, &ar);
+    }
+
+    arena_free(&ar);
+
+    return NULL;
+}
+
+/*
+ * run_uring - Convert the batch with thread_cnt workers, each reading
+ * and writing the files of a round with a single system call per step
+ * instead of several per file.
+ * Returns -1 if io_uring is not available.
+ */
+int run_uring(batch *b, long thread_cnt) {
+    uring_worker *workers;
+    long started;
+    long i;
+
+    workers = calloc(thread_cnt, sizeof(uring_worker));
+    if(workers == NULL)
+        return -1;
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->next_job = 0;
+
+    for(started = 0; started < thread_cnt; started++) {
+        workers[started].b = b;
+        workers[started].opt = b->opt;
+        // Smaller rounds for small batches, so all workers get files
+        workers[started].round = (b->job_cnt + thread_cnt - 1) / thread_cnt;
+        if(workers[started].round > URING_FILES)
+            workers[started].round = URING_FILES;
+        if(uring_init(&workers[started].u, URING_ENTRIES) != 0)
+            break;
+        if(pthread_create(&workers[started].thread, NULL, uring_thread, &workers[started]) != 0) {
+            uring_free(&workers[started].u);
+            break;
+        }
+    }
+
+    if(started > 0)
+        print_job_logs(b);
+
+    for(i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        uring_free(&workers[i].u);
+    }
+
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(workers);
+
+    return started > 0 ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_SOCKETS
+/*
+ * server_listen - Open the socket the server listens on. An address
+ * with a colon and without a slash is TCP, "host:port" or ":port" for
+ * all interfaces, anything else is the path of a Unix domain socket.
+ * Returns the socket, or -1 if it cannot be opened.
+ */
+int server_listen(char *address) {
+    struct sockaddr_un addr_un;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    struct stat st;
+    char host[256];
+    char *colon;
+    int fd = -1;
+    int on = 1;
+
+    colon = strrchr(address, ':');
+    if(colon != NULL && strchr(address, '/') == NULL) {
+        if(colon - address >= (long)sizeof(host))
+            return -1;
+        memcpy(host, address, colon - address);
+        host[colon - address] = 0;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if(getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0)
+            return -1;
+
+        for(ai = res; ai != NULL; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if(fd == -1)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+    else {
+        if(strlen(address) >= sizeof(addr_un.sun_path))
+            return -1;
+
+        // A socket left over from an earlier run is replaced
+        if(stat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(address);
+
+        memset(&addr_un, 0, sizeof(addr_un));
+        addr_un.sun_family = AF_UNIX;
+        strcpy(addr_un.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd != -1 && bind(fd, (struct sockaddr *)&addr_un, sizeof(addr_un)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if(fd != -1 && listen(fd, 64) != 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+/*
+ * read_full - Read exactly len bytes from a socket.
+ * Returns 0, 1 if the peer closed the connection before the first
+ * byte, or -1 on errors and on a connection closed in between.
+ */
+int read_full(int fd, char *buf, long len) {
+    ssize_t n;
+    long got = 0;
+
+    while(got < len) {
+        n = read(fd, buf + got, len - got);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return n == 0 && got == 0 ? 1 : -1;
+        got += n;
+    }
+
+    return 0;
+}
+
+/*
+ * server_reply - Send the status and the length of the data, followed
+ * by the pieces, all in one writev().
+ * Returns 0, or -1 if the connection failed.
+ */
+int server_reply(int fd, long status, out_piece *pieces, int piece_cnt) {
+    struct iovec iov[MAX_PIECES + 1];
+    char head[8];
+    long len = 0;
+    int i;
+
+    for(i = 0; i < piece_cnt; i++) {
+        iov[i + 1].iov_base = pieces[i].base;
+        iov[i + 1].iov_len = pieces[i].len;
+        len += pieces[i].len;
+    }
+
+    put_long(head, status);
+    put_long(head + 4, len);
+    iov[0].iov_base = head;
+    iov[0].iov_len = 8;
+
+    return write_iov(fd, iov, piece_cnt + 1);
+}
+
+/*
+ * server_error - Send a SONIC_ERR_* status with a message.
+ * Returns 0, or -1 if the connection failed.
+ */
+int server_error(int fd, long status, char *msg) {
+    out_piece piece;
+
+    piece.base = msg;
+    piece.len = strlen(msg);
+
+    return server_reply(fd, status, &piece, 1);
+}
+
+/*
+ * server_request - Read the input of a request and send back its
+ * conversion, straight from the input buffer and the arena of the
+ * worker, which are kept from one request to the next.
+ * Returns 0, or -1 if the connection is to be closed.
+ */
+int server_request(server_worker *w, int fd, long len) {
+    module_layout ml;
+    out_piece pieces[MAX_PIECES];
+    int piece_cnt;
+    char *head;
+    char *p;
+    long offset;
+
+    if(len > w->buf_size) {
+        p = realloc(w->buf, len);
+        if(p == NULL) {
+            // The input is not read, so the connection cannot go on
+            server_error(fd, SONIC_ERR_MEMORY, "Cannot allocate memory for input");
+            return -1;
+        }
+        w->buf = p;
+        w->buf_size = len;
+    }
+
+    if(read_full(fd, w->buf, len) != 0)
+        return -1;
+
+    arena_reset(&w->ar);
+    offset = find_module(w->buf, len, &ml, &w->ar);
+    if(offset == SONIC_ERR_NOT_FOUND)
+        return server_error(fd, offset, "Song not found");
+    if(offset < 0)
+        return server_error(fd, offset, "Cannot allocate memory for samples info");
+
+    head = arena_alloc(&w->ar, soar_head_size(&ml));
+    if(head == NULL)
+        return server_error(fd, SONIC_ERR_MEMORY, "Cannot allocate memory for output header");
+
+    piece_cnt = soar_pieces(w->buf, &ml, head, pieces);
+
+    return server_reply(fd, 0, pieces, piece_cnt);
+}
+
+/*
+ * server_next - Answer the next request of a connection. Each request
+ * is the input length as a big-endian long followed by the input.
+ * Returns 0, or -1 if the connection is closed or to be closed.
+ */
+int server_next(server_worker *w, int fd) {
+    char len_buf[4];
+    long len;
+
+    if(read_full(fd, len_buf, 4) != 0)
+        return -1;
+
+    len = get_long(len_buf);
+    if(len < 0 || len > SERVER_MAX_INPUT) {
+        server_error(fd, SONIC_ERR_BUFFER, "Input too large");
+        return -1;
+    }
+
+    return server_request(w, fd, len);
+}
+
+/*
+ * server_thread - Worker answering one request at a time, from any of
+ * the connections that have one waiting. Afterwards the connection is
+ * handed back to run_server() to wait for the next request.
+ */
+void *server_thread(void *arg) {
+    server_worker *w = arg;
+    server *s = w->s;
+    int fd;
+
+    for(;;) {
+        pthread_mutex_lock(&s->lock);
+        while(!s->stop && s->ready_first == s->ready_cnt)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if(s->stop) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        fd = s->ready[s->ready_first++];
+        pthread_mutex_unlock(&s->lock);
+
+        // Writes of a few bytes to a pipe are never split
+        if(server_next(w, fd) != 0 || write(s->wake[1], &fd, sizeof(fd)) != sizeof(fd))
+            close(fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * server_watch - Add a connection to those run_server() waits on.
+ * The connection is closed if out of memory.
+ */
+void server_watch(server *s, int fd) {
+    struct pollfd *fds;
+    long max;
+
+    if(s->fd_cnt == s->fd_max) {
+        max = s->fd_max * 2;
+        fds = realloc(s->fds, max * sizeof(struct pollfd));
+        if(fds == NULL) {
+            close(fd);
+            return;
+        }
+        s->fds = fds;
+        s->fd_max = max;
+    }
+
+    s->fds[s->fd_cnt].fd = fd;
+    s->fds[s->fd_cnt].events = POLLIN;
+    s->fds[s->fd_cnt].revents = 0;
+    s->fd_cnt++;
+}
+
+/*
+ * server_queue - Queue a connection with a request for the workers.
+ * The connection is closed if out of memory.
+ */
+void server_queue(server *s, int fd) {
+    int *ready;
+    long max;
+
+    pthread_mutex_lock(&s->lock);
+    if(s->ready_cnt == s->ready_max) {
+        if(s->ready_first > 0) {
+            memmove(s->ready, s->ready + s->ready_first, (s->ready_cnt - s->ready_first) * sizeof(int));
+            s->ready_cnt -= s->ready_first;
+            s->ready_first = 0;
+        } else {
+            max = s->ready_max ? s->ready_max * 2 : 64;
+            ready = realloc(s->ready, max * sizeof(int));
+            if(ready == NULL) {
+                pthread_mutex_unlock(&s->lock);
+                close(fd);
+                return;
+            }
+            s->ready = ready;
+            s->ready_max = max;
+        }
+    }
+    s->ready[s->ready_cnt++] = fd;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * server_accept - Take a new connection. Reads and writes on it time
+ * out, so a stalled client cannot keep a worker.
+ */
+void server_accept(server *s) {
+    struct timespec ts;
+    struct timeval tv;
+    int on = 1;
+    int fd;
+
+    fd = accept(s->fds[0].fd, NULL, NULL);
+    if(fd == -1) {
+        // E.g. out of file handles, wait for connections to close
+        if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10000000;
+            nanosleep(&ts, NULL);
+        }
+        return;
+    }
+
+    // Only the listening socket is non-blocking, on some systems the
+    // connection inherits it
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    tv.tv_sec = SERVER_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    // Fails on Unix domain sockets, which have no delay anyway
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    server_watch(s, fd);
+}
+
+/*
+ * run_server - Serve conversions on address with thread_cnt workers,
+ * until the process is stopped. The idle connections are watched here
+ * with poll(), and each request is queued for the next free worker, so
+ * a client keeping its connection open does not hold a worker.
+ * Returns -1 if the server cannot be started or fails.
+ */
+int run_server(char *address, long thread_cnt) {
+    server s;
+    server_worker *workers;
+    int back[64];
+    long started;
+    long i;
+    long n;
+    int fd;
+    int rc = 0;
+
+    memset(&s, 0, sizeof(s));
+    fd = server_listen(address);
+    if(fd == -1) {
+        printf("Cannot listen on: %s\n", address);
+        return -1;
+    }
+
+    s.fd_max = 64;
+    s.fds = malloc(s.fd_max * sizeof(struct pollfd));
+    workers = calloc(thread_cnt, sizeof(server_worker));
+    if(s.fds == NULL || workers == NULL || pipe(s.wake) != 0) {
+        free(s.fds);
+        free(workers);
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    s.fds[0].fd = fd;
+    s.fds[0].events = POLLIN;
+    s.fds[1].fd = s.wake[0];
+    s.fds[1].events = POLLIN;
+    s.fd_cnt = 2;
+
+    // A client going away must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    for(started = 0; started < thread_cnt; started++) {
+        workers[started].s = &s;
+        arena_init(&workers[started].ar);
+        if(pthread_create(&workers[started].thread, NULL, server_thread, &workers[started]) != 0)
+            break;
+    }
+
+    if(started == 0)
+        rc = -1;
+    else {
+        printf("Listening on %s with %ld worker(s)\n", address, started);
+        fflush(stdout);
+    }
+
+    while(rc == 0) {
+        if(poll(s.fds, s.fd_cnt, -1) == -1) {
+            if(errno != EINTR)
+                rc = -1;
+            continue;
+        }
+
+        // A request or the end of a connection goes to a worker
+        for(i = 2; i < s.fd_cnt; ) {
+            if(s.fds[i].revents != 0) {
+                server_queue(&s, s.fds[i].fd);
+                s.fds[i] = s.fds[--s.fd_cnt];
+            } else {
+                i++;
+            }
+        }
+
+        if(s.fds[1].revents != 0) {
+            n = read(s.wake[0], back, sizeof(back));
+            for(i = 0; i < n / (long)sizeof(int); i++)
+                server_watch(&s, back[i]);
+        }
+
+        if(s.fds[0].revents != 0)
+            server_accept(&s);
+    }
+
+    if(started > 0)
+        printf("Server failed on: %s\n", address);
+
+    pthread_mutex_lock(&s.lock);
+    s.stop = 1;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+    for(i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        arena_free(&workers[i].ar);
+        free(workers[i].buf);
+    }
+
+    for(i = 2; i < s.fd_cnt; i++)
+        close(s.fds[i].fd);
+    for(i = s.ready_first; i < s.ready_cnt; i++)
+        close(s.ready[i]);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    close(s.wake[0]);
+    close(s.wake[1]);
+    close(fd);
+    free(s.ready);
+    free(s.fds);
+    free(workers);
+
+    return rc;
+}
+#endif
+
+/*
+ * run_batch - Convert all jobs of the batch, using thread_cnt threads
+ * where threads are available, or thread_cnt pipelines or io_uring
+ * workers.
+ */
+void run_batch(batch *b, long thread_cnt, arena *ar) {
+    long i;
+
+#ifdef HAVE_PTHREAD
+    if(thread_cnt > b->job_cnt)
+        thread_cnt = b->job_cnt;
+#ifdef HAVE_IO_URING
+    if(b->uring && !b->scan && b->job_cnt > 0) {
+        if(run_uring(b, thread_cnt) == 0)
+            return;
+        printf("io_uring is not available, using normal file I/O.\n");
+    }
+#endif
+    if(b->pipeline && !b->scan && run_pipelined(b, thread_cnt) == 0)
+        return;
+    if(thread_cnt > 1 && run_threaded(b, thread_cnt) == 0)
+        return;
+#endif
+
+    for(i = 0; i < b->job_cnt; i++) {
+        b->jobs[i].rc = run_job(b, &b->jobs[i], ar, stdout);
+        b->jobs[i].done = 1;
+    }
+}
+
+/*
+ * free_batch - Release the job list.
+ */
+void free_batch(batch *b) {
+    long i;
+
+    for(i = 0; i < b->job_cnt; i++) {
+        free(b->jobs[i].in_name);
+        free(b->jobs[i].out_name);
+        free(b->jobs[i].log);
+    }
+    free(b->jobs);
+    manifest_free(&b->last);
+    memset(b, 0, sizeof(batch));
+}
+
+/*
+ * add_result - Add the counters of a file to the totals.
+ */
+void add_result(conv_result *sum, conv_result *r) {
+    sum->bytes_read += r->bytes_read;
+    sum->bytes_scanned += r->bytes_scanned;
+    sum->rejected += r->rejected;
+    sum->modules += r->modules;
+    sum->entries += r->entries;
+    sum->sample_bytes += r->sample_bytes;
+    sum->bytes_written += r->bytes_written;
+    sum->read_time += r->read_time;
+    sum->scan_time += r->scan_time;
+    sum->write_time += r->write_time;
+}
+
+/*
+ * mb_per_s - Throughput for the statistics.
+ */
+double mb_per_s(long bytes, double us) {
+    return us > 0 ? bytes / us * (1e6 / 1048576.0) : 0.0;
+}
+
+/*
+ * print_stats - Print the totals of a run of files. The stage times are
+ * summed over all files, elapsed is the wall clock time of the run.
+ */
+void print_stats(conv_result *sum, long files, double elapsed, FILE *out) {
+    fprintf(out, "\nStatistics for %ld file(s) in %.1f ms:\n", files, elapsed / 1e3);
+    fprintf(out, "  read   %ld bytes in %.1f ms, %.1f MB/s\n",
+        sum->bytes_read, sum->read_time / 1e3, mb_per_s(sum->bytes_read, sum->read_time));
+    fprintf(out, "  scan   %ld bytes in %.1f ms, %.1f MB/s, %ld candidate(s) rejected\n",
+        sum->bytes_scanned, sum->scan_time / 1e3, mb_per_s(sum->bytes_scanned, sum->scan_time), sum->rejected);
+    fprintf(out, "  write  %ld module(s), %ld entries, %ld sample bytes, %ld bytes in %.1f ms, %.1f MB/s\n",
+        sum->modules, sum->entries, sum->sample_bytes, sum->bytes_written, sum->write_time / 1e3,
+        mb_per_s(sum->bytes_written, sum->write_time));
+}
+
+/*
+ * print_json_string - Print a string as a JSON string to out. Bytes
+ * outside of ASCII are taken as ISO-8859-1, like on the Amiga.
+ */
+void print_json_string(char *str, FILE *out) {
+    unsigned char *p;
+
+    fputc('"', out);
+    for(p = (unsigned char *)str; *p; p++) {
+        if(*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if(*p < 0x20 || *p >= 0x7f)
+            fprintf(out, "\\u%04x", *p);
+        else
+            fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * print_json_result - Print the counters of a file or of the totals as
+ * JSON members to out.
+ */
+void print_json_result(conv_result *r, FILE *out) {
+    fprintf(out, "\"bytes_read\": %ld, \"bytes_scanned\": %ld, \"rejected\": %ld, "
+        "\"modules\": %ld, \"entries\": %ld, \"sample_bytes\": %ld, \"bytes_written\": %ld, "
+        "\"read_us\": %.1f, \"scan_us\": %.1f, \"write_us\": %.1f",
+        r->bytes_read, r->bytes_scanned, r->rejected, r->modules, r->entries,
+        r->sample_bytes, r->bytes_written, r->read_time, r->scan_time, r->write_time);
+}
+
+/*
+ * write_json - Write the statistics of a batch with one record per file
+ * and the totals to b->json_name.
+ * Returns 0, or -1 if the file cannot be written.
+ */
+int write_json(batch *b, conv_result *sum, double elapsed) {
+    FILE *out;
+    batch_job *job;
+    long i;
+    int rc;
+
+    out = fopen(b->json_name, "w");
+    if(out == NULL)
+        return -1;
+
+    fprintf(out, "{\n  \"files\": [\n");
+    for(i = 0; i < b->job_cnt; i++) {
+        job = &b->jobs[i];
+        fprintf(out, "    {\"file\": ");
+        print_json_string(job->in_name, out);
+        fprintf(out, ", \"status\": \"%s\", ", job->rc != 0 ? "failed" : job->skipped ? "unchanged" : "ok");
+        print_json_result(&job->res, out);
+        fprintf(out, "}%s\n", i + 1 < b->job_cnt ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"total\": {\"files\": %ld, \"elapsed_us\": %.1f, ", b->job_cnt, elapsed);
+    print_json_result(sum, out);
+    fprintf(out, "}\n}\n");
+
+    rc = ferror(out) ? -1 : 0;
+    if(fclose(out) != 0)
+        rc = -1;
+
+    return rc;
+}
+
+/*
+ * cpu_count - Number of CPUs available, 1 if unknown.
+ */
+long cpu_count(void) {
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return n > 0 ? n : 1;
+}
+
+void banner(FILE *out) {
+    fprintf(out, "sonicconv -- SonicArranger packed format converter\n");
+    fprintf(out, "by Thomas Meyer <mnemotron@gmail.com>\n\n");
+}
+
+void usage(void) {
+    printf("Usage: sonicconv [options] <inputfile> <outputfile>\n");
+    printf("       (- as inputfile reads standard input, as outputfile writes\n");
+    printf("       to standard output)\n");
+    printf("       sonicconv -d <outputdir> [options] <inputfile>...\n");
+    printf("       sonicconv -d <outputdir> [options] -f <listfile>\n");
+    printf("       sonicconv -P <archive> [options] <inputfile>...\n");
+    printf("       sonicconv -s [options] <inputfile>...\n");
+#ifdef HAVE_SOCKETS
+    printf("       sonicconv -S <address> [-j <threads>]\n");
+#endif
+    printf("\n");
+    printf("  -d <outputdir>  batch mode, write each conversion into outputdir\n");
+    printf("  -f <listfile>   read input file names from listfile, - for stdin\n");
+    printf("  -P <archive>    batch mode, write all conversions into one indexed file\n");
+    printf("  -s              only scan the files, print a CSV record for each\n");
+    printf("  -a              convert all modules in a file, not only the first\n");
+    printf("  -x              leave out instruments no note uses and their samples\n");
+    printf("  -c <cachedir>   reuse conversions of identical modules from cachedir\n");
+    printf("  -i <manifest>   batch mode, skip files unchanged since the last run\n");
+    printf("  -t              print statistics of reading, scanning and writing\n");
+    printf("  -J <jsonfile>   batch mode, write statistics per file as JSON\n");
+    printf("  -l              low memory, convert through a small buffer\n");
+#ifdef HAVE_PTHREAD
+    printf("  -j <threads>    convert with this many threads, 0 for one per CPU\n");
+    printf("  -p              batch mode, separate threads for reading, scanning and\n");
+    printf("                  writing, -j sets the number of these pipelines\n");
+#endif
+#ifdef HAVE_SOCKETS
+    printf("  -S <address>    serve conversions on a Unix socket path or TCP host:port\n");
+#endif
+#ifdef HAVE_IO_URING
+    printf("  -u              batch mode, read and write many files at once with\n");
+    printf("                  io_uring, -j sets the number of threads doing so\n");
+#endif
+}
+
+int main(int argc,char *argv[]) {
+    arena ar;
+    batch b;
+    conv_result res;
+    FILE *log = stdout;
+    char *list_name = NULL;
+#ifdef HAVE_SOCKETS
+    char *server_address = NULL;
+#endif
+    pack_file pack;
+    double t0;
+    long thread_cnt = 1;
+    long converted = 0;
+    long skipped = 0;
+    long failed = 0;
+    long j;
+    int i;
+
+    arena_init(&ar);
+    memset(&b, 0, sizeof(b));
+
+    for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+        if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            b.out_dir = argv[++i];
+        else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            list_name = argv[++i];
+        else if(strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+            b.pack_name = argv[++i];
+        else if(strcmp(argv[i], "-s") == 0)
+            b.scan = 1;
+        else if(strcmp(argv[i], "-a") == 0)
+            b.opt.all = 1;
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            b.opt.cache_dir = argv[++i];
+        else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            b.manifest_name = argv[++i];
+        else if(strcmp(argv[i], "-t") == 0)
+            b.stats = 1;
+        else if(strcmp(argv[i], "-J") == 0 && i + 1 < argc)
+            b.json_name = argv[++i];
+        else if(strcmp(argv[i], "-l") == 0)
+            b.opt.low_mem = 1;
+        else if(strcmp(argv[i], "-x") == 0)
+            b.opt.strip = 1;
+#ifdef HAVE_SOCKETS
+        else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            server_address = argv[++i];
+#endif
+#ifdef HAVE_PTHREAD
+        else if(strcmp(argv[i], "-p") == 0)
+            b.pipeline = 1;
+#ifdef HAVE_IO_URING
+        else if(strcmp(argv[i], "-u") == 0)
+            b.uring = 1;
+#endif
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            thread_cnt = atol(argv[++i]);
+            if(thread_cnt <= 0)
+                thread_cnt = cpu_count();
+        }
+#endif
+        else
+            break;
+    }
+
+#ifdef HAVE_SOCKETS
+    // The server only takes the number of workers
+    if(server_address != NULL) {
+        banner(stdout);
+        if(i < argc || b.out_dir != NULL || b.scan || list_name != NULL || b.opt.all
+            || b.opt.cache_dir != NULL || b.manifest_name != NULL || b.stats
+            || b.json_name != NULL || b.opt.low_mem || b.opt.strip || b.pipeline || b.uring) {
+            usage();
+            exit(10);
+        }
+        return run_server(server_address, thread_cnt) != 0 ? 20 : 0;
+    }
+
+#endif
+    // Messages must not get mixed into a conversion written to stdout
+    if(b.out_dir == NULL && !b.scan && argc - i == 2 && strcmp(argv[i + 1], "-") == 0)
+        log = stderr;
+
+    // The archive takes the place of the output directory, its entries
+    // are named like the files would be
+    if(b.pack_name != NULL && b.out_dir == NULL)
+        b.out_dir = "";
+
+    // The scan records are the only output in scan mode
+    if(!b.scan)
+        banner(log);
+
+    if((i < argc && argv[i][0] == '-' && argv[i][1] != 0)
+        || (b.out_dir == NULL && !b.scan && (list_name != NULL || argc - i != 2))
+        || ((b.out_dir != NULL || b.scan) && list_name == NULL && i >= argc)
+        || (b.out_dir != NULL && b.scan)
+        || (b.manifest_name != NULL && b.out_dir == NULL)
+        || (b.json_name != NULL && b.out_dir == NULL)
+        || (b.pipeline && b.out_dir == NULL)
+        || (b.uring && (b.out_dir == NULL || b.pipeline))
+        || (b.pack_name != NULL && (b.out_dir[0] != 0 || strcmp(b.pack_name, "-") == 0 || b.pipeline || b.uring || b.opt.cache_dir != NULL
+            || b.manifest_name != NULL || b.opt.low_mem))
+        || (b.stats && b.scan)
+        || (b.opt.low_mem && (b.opt.strip || b.scan || b.pipeline || b.uring || b.opt.cache_dir != NULL || b.manifest_name != NULL))
+        || (log == stderr && b.opt.all)) {
+        if(b.scan)
+            banner(stdout);
+        usage();
+        exit(10);
+    }
+
+    memset(&res, 0, sizeof(res));
+    t0 = now_us();
+
+    if(b.out_dir == NULL && !b.scan) {
+        // All threads search the one file
+        b.opt.scan_threads = thread_cnt;
+        if(convert(argv[i], argv[i + 1], &b.opt, &res, &ar, log) != 0)
+            failed++;
+        if(b.stats)
+            print_stats(&res, 1, now_us() - t0, log);
+    }
+    else {
+        for(; i < argc; i++) {
+            if(add_job(&b, argv[i]) != 0) {
+                printf("Cannot allocate memory for file list!\n");
+                exit(20);
+            }
+        }
+        if(list_name != NULL && read_list(&b, list_name) != 0)
+            failed++;
+
+        if(b.manifest_name != NULL) {
+            b.opt.hash_input = 1;
+            if(manifest_load(&b.last, b.manifest_name) != 0) {
+                printf("Cannot allocate memory for manifest!\n");
+                exit(20);
+            }
+        }
+
+        // Threads not needed for the files search them in parallel
+        if(b.job_cnt > 0 && thread_cnt > b.job_cnt)
+            b.opt.scan_threads = thread_cnt / b.job_cnt;
+
+        if(b.scan)
+            scan_header(stdout);
+
+        if(b.pack_name != NULL) {
+            if(pack_open(&pack, b.pack_name) != 0) {
+                printf("Cannot open file: %s\n", b.pack_name);
+                exit(20);
+            }
+            b.opt.pack = &pack;
+        }
+
+        run_batch(&b, thread_cnt, &ar);
+
+        if(b.pack_name != NULL) {
+            j = pack.cnt;
+            if(pack_close(&pack) == 0)
+                printf("\n%ld conversion(s) written to archive: %s\n", j, b.pack_name);
+            else {
+                printf("\nWrite error on file: %s\n", b.pack_name);
+                failed++;
+            }
+        }
+
+        for(j = 0; j < b.job_cnt; j++) {
+            if(b.jobs[j].rc != 0)
+                failed++;
+            else if(b.jobs[j].skipped)
+                skipped++;
+            else
+                converted++;
+            add_result(&res, &b.jobs[j].res);
+        }
+
+        if(b.manifest_name != NULL)
+            printf("\nConverted %ld file(s), %ld unchanged, %ld failed.\n", converted, skipped, failed);
+        else if(!b.scan)
+            printf("\nConverted %ld file(s), %ld failed.\n", converted, failed);
+        if(b.stats)
+            print_stats(&res, b.job_cnt, now_us() - t0, stdout);
+        if(b.json_name != NULL && write_json(&b, &res, now_us() - t0) != 0) {
+            printf("Cannot write statistics: %s\n", b.json_name);
+            failed++;
+        }
+        if(b.manifest_name != NULL && manifest_save(&b) != 0) {
+            printf("Cannot write manifest: %s\n", b.manifest_name);
+            failed++;
+        }
+        free_batch(&b);
+    }
+
+    arena_free(&ar);
+
+    return failed ? 10 : 0;
 }
@@ -0,0 +1,245 @@
+/*
+ * SonicArranger packed format converter - conversion library
+ *
+ * by Thomas Meyer <mnemotron@gmail.com>
+ * Created: 2026-10-14
+ * Last change: 2026-10-14
+ */
+
+#ifndef SONICCONV_H
+#define SONICCONV_H
+
+/*
+ * Fixed-width types for fields of the file formats. SAS/C 6.5 has no
+ * <stdint.h>, but long is 32 bits on the Amiga.
+ */
+#if defined(__SASC)
+typedef long s32;
+typedef unsigned long u32;
+typedef unsigned short u16;
+#else
+#include <stdint.h>
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef uint16_t u16;
+#endif
+
+/* error codes returned by the library functions */
+#define SONIC_ERR_NOT_FOUND -1  // no module found in the input
+#define SONIC_ERR_BUFFER    -2  // output buffer too small
+#define SONIC_ERR_MEMORY    -3  // out of memory
+#define SONIC_ERR_FORMAT    -4  // damaged or unsupported container
+
+/* container formats recognized by container_type() */
+#define CONTAINER_NONE 0
+#define CONTAINER_ADF  1    // AmigaDOS OFS/FFS disk image
+#define CONTAINER_LHA  2    // LhA archive
+#define CONTAINER_LZX  3    // LZX archive, recognized but not unpacked
+
+/* highest sample id of a sampled instrument in a plausible module */
+#define MAX_SAMPLE_ID 0xff
+
+/* maximum number of pieces an output file is gathered from */
+#define MAX_PIECES 18
+
+/* struct for storing data per sample */
+typedef struct {
+    // length in bytes
+    s32 length;
+    // length in words
+    s32 length_from_instr;
+    // repeat in words
+    s32 repeat_from_instr;
+    // pointer to name entry in instrument table
+    char* name_from_instr;
+} sample_info;
+
+/* section of a module: offset in the input, length in bytes, entries */
+typedef struct {
+    long offset;
+    long len;
+    long cnt;
+} module_section;
+
+/*
+ * Called by container_members() for every member of a container, a
+ * nonzero return stops the walk.
+ */
+typedef int (*member_func)(char *name, char *dat, long size, void *ctx);
+
+/* layout of a module in the input, built by parse_module() */
+typedef struct {
+    // offset of the module in the input
+    long offset;
+    module_section song;
+    module_section over;
+    module_section note;
+    module_section instr;
+    module_section wave;
+    module_section adsr;
+    module_section amf;
+    // offset of the sample table, length of all sample data, samples
+    module_section sample;
+    long sample_data_offset;
+    // sample.cnt entries gathered from the instruments, may be NULL
+    sample_info *samples;
+    // sampled instruments referring to a sample that does not exist
+    long bad_sample_ids;
+    // findsong() hits rejected by find_module_from() before this module
+    long rejected;
+} module_layout;
+
+/* piece of output data, written in order */
+typedef struct {
+    char *base;
+    long len;
+} out_piece;
+
+/* memory block of an arena, the data follows the header */
+typedef struct arena_block {
+    struct arena_block *next;
+    long size;
+    long used;
+} arena_block;
+
+/*
+ * Per-conversion scratch memory. Allocations are carved from large
+ * blocks and all released at once by arena_reset(), which keeps the
+ * memory for the next conversion.
+ */
+typedef struct {
+    arena_block *head;
+} arena;
+
+/*
+ * Big-endian field access. The 68000 reads the fields directly, which
+ * is fine as all of them are word aligned. Other hosts load the bytes
+ * with memcpy(), which compilers turn into a single (unaligned) load,
+ * and swap them with one instruction where needed.
+ */
+#if defined(__SASC)
+#define SONIC_INLINE static __inline
+#elif defined(__GNUC__)
+#define SONIC_INLINE static __inline__
+#else
+#define SONIC_INLINE static
+#endif
+
+#if defined(__SASC) || defined(__mc68000__) || defined(mc68000)
+#define SONIC_NATIVE_BE
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SONIC_MEMCPY_BE
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SONIC_MEMCPY_LE
+#endif
+
+#if defined(SONIC_MEMCPY_BE) || defined(SONIC_MEMCPY_LE)
+#include <string.h>
+#endif
+
+/*
+ * get_long - Read a big-endian long at p.
+ */
+SONIC_INLINE s32 get_long(char *p) {
+#if defined(SONIC_NATIVE_BE)
+    return *(s32 *)p;
+#elif defined(SONIC_MEMCPY_BE)
+    s32 v;
+
+    memcpy(&v, p, 4);
+    return v;
+#elif defined(SONIC_MEMCPY_LE)
+    u32 v;
+
+    memcpy(&v, p, 4);
+    return (s32)__builtin_bswap32(v);
+#else
+    unsigned char *u = (unsigned char *)p;
+
+    return (s32)(((u32)u[0] << 24) | ((u32)u[1] << 16) | ((u32)u[2] << 8) | u[3]);
+#endif
+}
+
+/*
+ * get_word - Read a big-endian unsigned word at p.
+ */
+SONIC_INLINE u16 get_word(char *p) {
+#if defined(SONIC_NATIVE_BE)
+    return *(u16 *)p;
+#elif defined(SONIC_MEMCPY_BE)
+    u16 v;
+
+    memcpy(&v, p, 2);
+    return v;
+#elif defined(SONIC_MEMCPY_LE)
+    u16 v;
+
+    memcpy(&v, p, 2);
+    return __builtin_bswap16(v);
+#else
+    unsigned char *u = (unsigned char *)p;
+
+    return (u16)((u[0] << 8) | u[1]);
+#endif
+}
+
+/*
+ * put_long - Store a long as big-endian at p.
+ */
+SONIC_INLINE void put_long(char *p, s32 v) {
+#if defined(SONIC_NATIVE_BE)
+    *(s32 *)p = v;
+#elif defined(SONIC_MEMCPY_BE)
+    memcpy(p, &v, 4);
+#elif defined(SONIC_MEMCPY_LE)
+    u32 w = __builtin_bswap32((u32)v);
+
+    memcpy(p, &w, 4);
+#else
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+#endif
+}
+
+extern char SOAR_ID [];
+extern char STBL_ID [];
+extern char OVTB_ID [];
+extern char NTBL_ID [];
+extern char INST_ID [];
+extern char SD8B_ID [];
+extern char SYWT_ID [];
+extern char SYAR_ID [];
+extern char SYAF_ID [];
+extern char EDAT_ID [];
+extern char EDAT_DATA [];
+
+void arena_init(arena *a);
+void *arena_alloc(arena *a, long size);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+long findsong(char *data, long size);
+
+char *put_chunk(char *p, char *id, long cnt);
+
+void parse_section(module_section *sec, long start, long end, long entry_size);
+int parse_module(char *in, long in_size, long offset, module_layout *ml, arena *a);
+long find_module_from(char *in, long in_size, long start, module_layout *ml, arena *a);
+long find_module(char *in, long in_size, module_layout *ml, arena *a);
+long module_end(module_layout *ml);
+long strip_module(char *in, module_layout *ml, char **out, arena *a);
+void sonic_hash(char *p, long len, u32 h[2]);
+long soar_head_size(module_layout *ml);
+long soar_output_size(module_layout *ml);
+int soar_pieces(char *in, module_layout *ml, char *head, out_piece *pieces);
+
+long sonic_output_size(char *in, long in_size);
+long sonic_convert(char *in, long in_size, char *out, long out_size, arena *a);
+
+int container_type(char *in, long in_size);
+char *container_name(int type);
+long container_members(char *in, long in_size, member_func fn, void *ctx, arena *a);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * SonicArranger packed format converter - Python extension
+ *
+ * Makes the conversion library usable from Python as the module
+ * _sonicconv, which sonicconv.py uses when it is built. The input is
+ * taken from any bytes-like object without copying it, and the GIL is
+ * released while searching and converting, so threads of a Python
+ * program convert in parallel.
+ *
+ * Build with "make python". Everything but PyInit__sonicconv() is
+ * static or, for the library, hidden by -fvisibility=hidden, so nothing
+ * else clashes with the symbols of the interpreter.
+ *
+ * by Thomas Meyer <mnemotron@gmail.com>
+ * Created: 2026-10-14
+ * Last change: 2026-10-14
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <limits.h>
+
+#include "sonicconv.h"
+
+/* _sonicconv.error, raised if there is no module in the input */
+static PyObject *sonic_error;
+
+/*
+ * layout_dict - Describe a module layout as a dict. The sections are
+ * (offset, length, entries) tuples, for "sample" the offset of the
+ * sample table, the length of all sample data and the samples.
+ * Returns a new reference, or NULL with an exception set.
+ */
+static PyObject *layout_dict(module_layout *ml) {
+    return Py_BuildValue("{s:l,s:(lll),s:(lll),s:(lll),s:(lll),s:(lll),s:(lll),s:(lll),s:(lll),s:l}",
+        "offset", ml->offset,
+        "song", ml->song.offset, ml->song.len, ml->song.cnt,
+        "over", ml->over.offset, ml->over.len, ml->over.cnt,
+        "note", ml->note.offset, ml->note.len, ml->note.cnt,
+        "instr", ml->instr.offset, ml->instr.len, ml->instr.cnt,
+        "wave", ml->wave.offset, ml->wave.len, ml->wave.cnt,
+        "adsr", ml->adsr.offset, ml->adsr.len, ml->adsr.cnt,
+        "amf", ml->amf.offset, ml->amf.len, ml->amf.cnt,
+        "sample", ml->sample.offset, ml->sample.len, ml->sample.cnt,
+        "sample_data_offset", ml->sample_data_offset);
+}
+
+/*
+ * search - Find the first module in the input, without the GIL.
+ * Returns 0, or -1 with an exception set.
+ */
+static int search(Py_buffer *view, module_layout *ml, arena *a) {
+    long rc;
+
+    if(view->len > LONG_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "input too large");
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = find_module(view->buf, (long)view->len, ml, a);
+    Py_END_ALLOW_THREADS
+
+    if(rc == SONIC_ERR_NOT_FOUND) {
+        PyErr_SetString(sonic_error, "song not found");
+        return -1;
+    }
+    if(rc < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * sonic_layout_py - layout(data): find the first module in data.
+ */
+static PyObject *sonic_layout_py(PyObject *self, PyObject *args) {
+    Py_buffer view;
+    module_layout ml;
+    arena a;
+    PyObject *res = NULL;
+
+    (void)self;
+    if(!PyArg_ParseTuple(args, "y*:layout", &view))
+        return NULL;
+
+    arena_init(&a);
+    if(search(&view, &ml, &a) == 0)
+        res = layout_dict(&ml);
+    arena_free(&a);
+    PyBuffer_Release(&view);
+
+    return res;
+}
+
+/*
+ * sonic_convert_py - convert(data): convert the first module in data.
+ * Returns a tuple of the SOAR output as bytes and the layout dict.
+ */
+static PyObject *sonic_convert_py(PyObject *self, PyObject *args) {
+    Py_buffer view;
+    module_layout ml;
+    out_piece pieces[MAX_PIECES];
+    arena a;
+    PyObject *out = NULL;
+    PyObject *layout;
+    PyObject *res = NULL;
+    char *head = NULL;
+    char *p;
+    int piece_cnt;
+    int i;
+
+    (void)self;
+    if(!PyArg_ParseTuple(args, "y*:convert", &view))
+        return NULL;
+
+    arena_init(&a);
+    if(search(&view, &ml, &a) == 0)
+        out = PyBytes_FromStringAndSize(NULL, soar_output_size(&ml));
+
+    if(out != NULL) {
+        // Nothing else sees the new bytes object yet
+        p = PyBytes_AS_STRING(out);
+        Py_BEGIN_ALLOW_THREADS
+        head = arena_alloc(&a, soar_head_size(&ml));
+        if(head != NULL) {
+            piece_cnt = soar_pieces(view.buf, &ml, head, pieces);
+            for(i = 0; i < piece_cnt; i++) {
+                memcpy(p, pieces[i].base, pieces[i].len);
+                p += pieces[i].len;
+            }
+        }
+        Py_END_ALLOW_THREADS
+
+        layout = head != NULL ? layout_dict(&ml) : PyErr_NoMemory();
+        if(layout != NULL)
+            res = PyTuple_Pack(2, out, layout);
+        Py_XDECREF(layout);
+        Py_DECREF(out);
+    }
+
+    arena_free(&a);
+    PyBuffer_Release(&view);
+
+    return res;
+}
+
+static PyMethodDef sonic_methods[] = {
+    { "convert", sonic_convert_py, METH_VARARGS,
+      "convert(data) -> (output, layout)\n\n"
+      "Convert the first SonicArranger module in the bytes-like object data.\n"
+      "Returns the SOAR output as bytes and the layout of the module as\n"
+      "returned by layout(). Raises error if there is no module." },
+    { "layout", sonic_layout_py, METH_VARARGS,
+      "layout(data) -> dict\n\n"
+      "Find the first SonicArranger module in the bytes-like object data.\n"
+      "Returns a dict with its offset, the sections as (offset, length,\n"
+      "entries) tuples and sample_data_offset. For \"sample\" these are the\n"
+      "offset of the sample table, the length of all sample data and the\n"
+      "number of samples. Raises error if there is no module." },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef sonic_module = {
+    PyModuleDef_HEAD_INIT,
+    "_sonicconv",
+    "SonicArranger packed format converter, using the C library.",
+    -1,
+    sonic_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__sonicconv(void) {
+    PyObject *m;
+
+    m = PyModule_Create(&sonic_module);
+    if(m == NULL)
+        return NULL;
+
+    sonic_error = PyErr_NewException("_sonicconv.error", PyExc_ValueError, NULL);
+    if(sonic_error == NULL || PyModule_AddObject(m, "error", sonic_error) != 0) {
+        Py_XDECREF(sonic_error);
+        Py_DECREF(m);
+        return NULL;
+    }
+    // PyModule_AddObject() took the reference, keep one for raising
+    Py_INCREF(sonic_error);
+
+    return m;
+}
@@ -7,7 +7,7 @@
 #
 # by Thomas Meyer <mnemotron@gmail.com>
 # Created: 2022-05-31
-# Last change: 2022-06-02
+# Last change: 2026-10-14
 #
 # Based on:
 # http://old.exotica.org.uk/tunes/formats/sonic/SONIC_AR.TXT
@@ -16,9 +16,67 @@
 # This is not supposed to be an example of good, structured programming.
 #
 
+import os
 import sys
 import struct
 
+# The C library does the conversion a lot faster, if its extension has
+# been built with "make python" in the Amiga directory.
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "Amiga"))
+try:
+    import _sonicconv
+except ImportError:
+    _sonicconv = None
+
+
+def print_layout(sections, sample_offset, sample_cnt, sample_data_offset, sample_len):
+    for (name, (sec_offset, sec_len, sec_cnt)) in sections:
+        print(f"{name + '=':7}0x{sec_offset:05x} len=0x{sec_len:05x} cnt=0x{sec_cnt:02x}")
+    print(f"sample=0x{sample_offset:05x} num=0x{sample_cnt:02x}")
+    print(f"sample_data=0x{sample_data_offset:05x} len=0x{sample_len:05x} end=0x{sample_data_offset + sample_len:05x}")
+
+
+# Plausibility check of a song data hit, the same as check_module() of
+# the C library.
+ENTRY_SIZES = (12, 16, 4, 0x98, 128, 128, 128)
+MAX_SAMPLE_ID = 0xff
+
+
+def check_module(dat, offset):
+    # The sections must follow each other inside the file and hold whole
+    # entries, the sample table and sample data must fit in the file and
+    # sampled instruments must not have a sample id only random data has.
+    dat_len = len(dat)
+    if offset > dat_len - 32:
+        return False
+    sections = []
+    for value in struct.unpack_from(">8l", dat, offset):
+        if value < 0 or value > dat_len:
+            return False
+        sections.append(offset + value)
+    for i in range(0, 7):
+        if sections[i + 1] < sections[i] or (sections[i + 1] - sections[i]) % ENTRY_SIZES[i] != 0:
+            return False
+    if sections[7] > dat_len - 4:
+        return False
+
+    sample_cnt = struct.unpack_from(">l", dat, sections[7])[0]
+    free_len = dat_len - sections[7] - 4
+    if sample_cnt < 0 or sample_cnt > free_len // 4:
+        return False
+    free_len -= sample_cnt * 4
+    for sample_len in struct.unpack_from(f">{sample_cnt}l", dat, sections[7] + 4):
+        if sample_len < 0 or sample_len > free_len:
+            return False
+        free_len -= sample_len
+
+    for i_offset in range(sections[3], sections[4], 0x98):
+        (instr_mode, instr_sample_id) = struct.unpack_from(">HH", dat, i_offset)
+        if instr_mode == 0 and instr_sample_id > MAX_SAMPLE_ID:
+            return False
+    return True
+
+
 print("sonicconv -- SonicArranger packed format converter")
 print("by Thomas Meyer\n")
 
@@ -41,15 +99,36 @@ except FileNotFoundError:
 dat_len = len(dat)
 print(f"File size: 0x{dat_len:x}")
 
+if _sonicconv is not None:
+    try:
+        (out, layout) = _sonicconv.convert(dat)
+    except _sonicconv.error:
+        print("*** Error: SonicArranger module not found in file!")
+        sys.exit(0)
+    print(f"Song found at offset: 0x{layout['offset']:x}")
+    (sample_offset, sample_len, sample_cnt) = layout["sample"]
+    print_layout([(name, layout[name]) for name in ("song", "over", "note", "instr", "wave", "adsr", "amf")],
+                 sample_offset, sample_cnt, layout["sample_data_offset"], sample_len)
+    with open(out_filename, "wb") as f:
+        f.write(out)
+    print(f"Output written to: {out_filename}")
+    sys.exit()
+
 # Find beginning of the song data. We search for the song offset, which
 # should be 0x00000028. Then we check the 32-bit value after that to be
-# larger than 0x28, but less than 0x200. Should suffice.
+# larger than 0x28, but less than 0x400, and the hit with check_module().
+# These are the rules of the C library, so the same module is found with
+# or without the extension.
+# bytes.find() does the searching, only its hits are checked here.
 offset = -1
-for index in range(0, dat_len - 0x28, 2):
-    (val1, val2) = struct.unpack_from(">LL", dat, index)
-    if val1 == 0x28 and val2 > val1 and val2 < 0x200:
-        offset = index
-        break
+index = dat.find(b"\x00\x00\x00\x28")
+while 0 <= index < dat_len - 0x28:
+    if index % 2 == 0:
+        val2 = struct.unpack_from(">L", dat, index + 4)[0]
+        if val2 > 0x28 and val2 < 0x400 and check_module(dat, index):
+            offset = index
+            break
+    index = dat.find(b"\x00\x00\x00\x28", index + 1)
 
 if offset < 0:
     print("*** Error: SonicArranger module not found in file!")
@@ -95,14 +174,12 @@ sample_lengths_from_instr = [0] * sample_cnt
 sample_repeats_from_instr = [0] * sample_cnt
 for instr_id in range(0, instr_cnt):
     i_offset = instr_offset + instr_id * 0x98
-    instr_mode = struct.unpack_from(">H", dat, i_offset)[0]
-    instr_sample_id = struct.unpack_from(">H", dat, i_offset + 2)[0]
-    instr_sample_len = struct.unpack_from(">H", dat, i_offset + 4)[0]
-    instr_sample_repeat = struct.unpack_from(">H", dat, i_offset + 6)[0]
+    (instr_mode, instr_sample_id, instr_sample_len, instr_sample_repeat) = struct.unpack_from(">HHHH", dat, i_offset)
     instr_name = dat[i_offset + 0x7a:i_offset + 0x7a + 30]
     instr_names.append(instr_name)
-    # If this is a sampled instrument, store information at sample id offset
-    if instr_mode == 0:
+    # If this is a sampled instrument, store information at sample id offset.
+    # Ids without a sample are ignored, as by the C library.
+    if instr_mode == 0 and instr_sample_id < sample_cnt:
         sample_names[instr_sample_id] = instr_name
         sample_lengths_from_instr[instr_sample_id] = instr_sample_len * 2
         sample_repeats_from_instr[instr_sample_id] = instr_sample_repeat
@@ -113,53 +190,46 @@ for instr_id in range(0, instr_cnt):
 # + 0 long:    number of samples
 # + 4 long []: sample length in bytes
 # + xx:        sampledata
-sample_len = 0
-sample_lengths = []
-for sample_length_offset in range(0, sample_cnt):
-    this_sample_len = struct.unpack_from(">L", dat, sample_offset + 4 + sample_length_offset * 4)[0]
-    sample_len += this_sample_len
-    sample_lengths.append(this_sample_len)
+sample_lengths = struct.unpack_from(f">{sample_cnt}L", dat, sample_offset + 4)
+sample_len = sum(sample_lengths)
 
 sample_data_offset = sample_offset + 4 + sample_cnt * 4
 
-print(f"song=  0x{song_offset:05x} len=0x{song_len:05x} cnt=0x{song_cnt:02x}")
-print(f"over=  0x{over_offset:05x} len=0x{over_len:05x} cnt=0x{over_cnt:02x}")
-print(f"note=  0x{note_offset:05x} len=0x{note_len:05x} cnt=0x{note_cnt:02x}")
-print(f"instr= 0x{instr_offset:05x} len=0x{instr_len:05x} cnt=0x{instr_cnt:02x}")
-print(f"wave=  0x{wave_offset:05x} len=0x{wave_len:05x} cnt=0x{wave_cnt:02x}")
-print(f"adsr=  0x{adsr_offset:05x} len=0x{adsr_len:05x} cnt=0x{adsr_cnt:02x}")
-print(f"amf=   0x{amf_offset:05x} len=0x{amf_len:05x} cnt=0x{amf_cnt:02x}")
-print(f"sample=0x{sample_offset:05x} num=0x{sample_cnt:02x}")
-print(f"sample_data=0x{sample_data_offset:05x} len=0x{sample_len:05x} end=0x{sample_data_offset + sample_len:05x}")
-
-# Write the output file
+print_layout([("song", (song_offset, song_len, song_cnt)),
+              ("over", (over_offset, over_len, over_cnt)),
+              ("note", (note_offset, note_len, note_cnt)),
+              ("instr", (instr_offset, instr_len, instr_cnt)),
+              ("wave", (wave_offset, wave_len, wave_cnt)),
+              ("adsr", (adsr_offset, adsr_len, adsr_cnt)),
+              ("amf", (amf_offset, amf_len, amf_cnt))],
+             sample_offset, sample_cnt, sample_data_offset, sample_len)
+
+# Write the output file. The sections are written from a memoryview of
+# the input, which doesn't copy them like slicing the bytes would.
+mv = memoryview(dat)
 with open(out_filename, "wb") as f:
     f.write("SOARV1.0".encode('ascii'))
     f.write("STBL".encode('ascii') + struct.pack(">L", song_cnt))
-    f.write(dat[song_offset:over_offset])
+    f.write(mv[song_offset:over_offset])
     f.write("OVTB".encode('ascii') + struct.pack(">L", over_cnt))
-    f.write(dat[over_offset:note_offset])
+    f.write(mv[over_offset:note_offset])
     f.write("NTBL".encode('ascii') + struct.pack(">L", note_cnt))
-    f.write(dat[note_offset:instr_offset])
+    f.write(mv[note_offset:instr_offset])
     f.write("INST".encode('ascii') + struct.pack(">L", instr_cnt))
-    f.write(dat[instr_offset:wave_offset])
+    f.write(mv[instr_offset:wave_offset])
     f.write("SD8B".encode('ascii') + struct.pack(">L", sample_cnt))
     # Recreate sample info
-    for i in range(0, sample_cnt):
-        f.write(struct.pack(">L", sample_lengths_from_instr[i] // 2))
-    for i in range(0, sample_cnt):
-        f.write(struct.pack(">L", sample_repeats_from_instr[i]))
-    for i in range(0, sample_cnt):
-        f.write(sample_names[i])
-    for i in range(0, sample_cnt):
-        f.write(struct.pack(">L", sample_lengths[i]))
-    f.write(dat[sample_data_offset:sample_data_offset + sample_len])
+    f.write(struct.pack(f">{sample_cnt}L", *[l // 2 for l in sample_lengths_from_instr]))
+    f.write(struct.pack(f">{sample_cnt}L", *sample_repeats_from_instr))
+    f.write(b"".join(sample_names))
+    f.write(struct.pack(f">{sample_cnt}L", *sample_lengths))
+    f.write(mv[sample_data_offset:sample_data_offset + sample_len])
     f.write("SYWT".encode('ascii') + struct.pack(">L", wave_cnt))
-    f.write(dat[wave_offset:adsr_offset])
+    f.write(mv[wave_offset:adsr_offset])
     f.write("SYAR".encode('ascii') + struct.pack(">L", adsr_cnt))
-    f.write(dat[adsr_offset:amf_offset])
+    f.write(mv[adsr_offset:amf_offset])
     f.write("SYAF".encode('ascii') + struct.pack(">L", amf_cnt))
-    f.write(dat[amf_offset:sample_offset])
+    f.write(mv[amf_offset:sample_offset])
     f.write("EDATV1.1".encode('ascii'))
     # Write some standard editor prefs. These are not in the binary source.
     f.write(bytes.fromhex("00 01 00 01 00 00 00 7b 00 00 00 00 00 01 00 03"))